@@ -7,6 +7,8 @@
 #include "scene/material.h"
 #include "scene/ray.h"
 #include "scene/kdTree.h"
+#include "scene/bvh.h"
+#include "scene/packet.h"
 
 #include "parser/Tokenizer.h"
 #include "parser/Parser.h"
@@ -52,6 +54,7 @@ glm::dvec3 RayTracer::trace(double x, double y)
 
 	ray r(glm::dvec3(0,0,0), glm::dvec3(0,0,0), glm::dvec3(1,1,1), ray::VISIBILITY);
 	scene->getCamera().rayThrough(x,y,r);
+	r.setFootprint(0.0, pixelSpread);
 	double dummy;
 
 
@@ -60,6 +63,86 @@ glm::dvec3 RayTracer::trace(double x, double y)
 	return ret;
 }
 
+// Same as trace, for n <= PACKET_SIZE neighbouring points at once.  The
+// camera rays go through the kd-tree as one packet, and so do the shadow
+// rays from their hits towards each point light.  Everything after that
+// (the other lights, reflection, refraction) is traced one ray at a time.
+void RayTracer::tracePacket(int n, const double* x, const double* y, glm::dvec3* colors)
+{
+	int depth = traceUI->getDepth();
+
+	std::vector<ray> rays;
+	rays.reserve(n);
+	for (int k = 0; k < n; k++) {
+		rays.emplace_back(glm::dvec3(0,0,0), glm::dvec3(0,0,0), glm::dvec3(1,1,1), ray::VISIBILITY);
+		scene->getCamera().rayThrough(x[k], y[k], rays[k]);
+		rays[k].setFootprint(0.0, pixelSpread);
+	}
+	if (depth <= 0) {
+		std::fill(colors, colors + n, glm::dvec3(0,0,0));
+		return;
+	}
+
+	isect hits[PACKET_SIZE];
+	RayPacket packet;
+	for (int k = 0; k < n; k++)
+		packet.add(&rays[k], &hits[k]);
+	unsigned hitMask = scene->intersect(packet);
+
+	const auto& lights = scene->getAllLights();
+	size_t numLights = lights.size();
+	std::vector<glm::dvec3> shadows(n * numLights, glm::dvec3(1,1,1));
+	std::vector<ray> shadowRays;
+	shadowRays.reserve(n);
+	for (size_t l = 0; l < numLights; l++) {
+		const PointLight* point = dynamic_cast<const PointLight*>(lights[l].get());
+
+		double dist[PACKET_SIZE];
+		int lane[PACKET_SIZE];
+		RayPacket shadowPacket;
+		shadowRays.clear();
+		for (int k = 0; k < n; k++) {
+			if (!(hitMask & (1u << k)))
+				continue;
+			glm::dvec3 Q = rays[k].at(hits[k].getT());
+			if (!point) {
+				shadows[k * numLights + l] = lights[l]->shadowAttenuation(rays[k], Q);
+				continue;
+			}
+			double d;
+			ray shadow = point->shadowRay(rays[k], Q, d);
+			if (point->lastOccluderBlocks(shadow, d)) {
+				shadows[k * numLights + l] = glm::dvec3(0,0,0);
+				continue;
+			}
+			lane[shadowRays.size()] = k;
+			dist[shadowRays.size()] = d;
+			shadowRays.push_back(shadow);
+		}
+		for (size_t s = 0; s < shadowRays.size(); s++)
+			shadowPacket.add(&shadowRays[s], nullptr);
+		if (shadowPacket.size == 0)
+			continue;
+
+		const Geometry* blockers[PACKET_SIZE];
+		unsigned blocked = scene->occluded(shadowPacket, dist, blockers);
+		for (int s = 0; s < shadowPacket.size; s++) {
+			if (blocked & (1u << s)) {
+				shadows[lane[s] * numLights + l] = glm::dvec3(0,0,0);
+				point->setLastOccluder(blockers[s]);
+			}
+		}
+	}
+
+	for (int k = 0; k < n; k++) {
+		double dummy = 0;
+		colors[k] = shadeHit(rays[k], hits[k], (hitMask & (1u << k)) != 0,
+		                     glm::dvec3(1.0,1.0,1.0), depth, dummy,
+		                     numLights ? &shadows[k * numLights] : nullptr);
+		colors[k] = glm::clamp(colors[k], 0.0, 1.0);
+	}
+}
+
 glm::dvec3 RayTracer::tracePixel(int i, int j)
 {
 	glm::dvec3 col(0,0,0);
@@ -71,29 +154,50 @@ glm::dvec3 RayTracer::tracePixel(int i, int j)
 	
 	unsigned char *pixel = buffer.data() + ( i + j * buffer_width ) * 3;
 
+	col = trace(x, y);
+
+	pixel[0] = (int)( 255.0 * col[0]);
+	pixel[1] = (int)( 255.0 * col[1]);
+	pixel[2] = (int)( 255.0 * col[2]);
+	return col;
+}
+
+// Unweighted average of samples x samples rays spread evenly over pixel(i,j).
+glm::dvec3 RayTracer::supersample(int i, int j)
+{
+	glm::dvec3 col(0,0,0);
 
-	if(traceUI->aaSwitch()){
-		//If anti aliasing switch is checked, perform an unweighted average on pixelSamples rays cast in each direction
-		double pixelSamples = traceUI->getSuperSamples() * 1.0;
-		double interval = 1.0/pixelSamples;
-		for(int n = 0; n < pixelSamples; n++){
-			for(int m = 0; m < pixelSamples; m++){
-				col += trace(x + n*(interval/double(buffer_width)), y + m*(interval/double(buffer_height)));
+	double x = double(i)/double(buffer_width);
+	double y = double(j)/double(buffer_height);
+	double interval = 1.0/samples;
+	if (packets) {
+		// Fill packets in the same order as the loop below, so the sum
+		// comes out the same.
+		double xs[PACKET_SIZE], ys[PACKET_SIZE];
+		glm::dvec3 cols[PACKET_SIZE];
+		int count = 0;
+		for(int n = 0; n < samples; n++){
+			for(int m = 0; m < samples; m++){
+				xs[count] = x + n*(interval/double(buffer_width));
+				ys[count] = y + m*(interval/double(buffer_height));
+				if (++count == PACKET_SIZE || (n == samples - 1 && m == samples - 1)) {
+					tracePacket(count, xs, ys, cols);
+					for (int k = 0; k < count; k++)
+						col += cols[k];
+					count = 0;
+				}
 			}
 		}
-
-		col = col * (1.0 / (pixelSamples * pixelSamples));
-	} else {
-		col = trace(x, y);
+		return col * (1.0 / (samples * samples));
 	}
-	
 
-	
+	for(int n = 0; n < samples; n++){
+		for(int m = 0; m < samples; m++){
+			col += trace(x + n*(interval/double(buffer_width)), y + m*(interval/double(buffer_height)));
+		}
+	}
 
-	pixel[0] = (int)( 255.0 * col[0]);
-	pixel[1] = (int)( 255.0 * col[1]);
-	pixel[2] = (int)( 255.0 * col[2]);
-	return col;
+	return col * (1.0 / (samples * samples));
 }
 
 #define VERBOSE 0
@@ -103,7 +207,6 @@ glm::dvec3 RayTracer::tracePixel(int i, int j)
 glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, double& t )
 {
 	isect i;
-	glm::dvec3 colorC;
 #if VERBOSE
 	std::cerr << "== current depth: " << depth << std::endl;
 #endif
@@ -111,7 +214,17 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 	if(depth <= 0){
 		return glm::dvec3(0,0,0);
 	}
-	if(scene->intersect(r, i)) {
+	return shadeHit(r, i, scene->intersect(r, i), thresh, depth, t, nullptr);
+}
+
+// The color seen along r, which hit i if hit is set and escaped to
+// infinity otherwise.  shadows, if given, are the shadow attenuations of
+// all the lights at the hit, as handed to Material::shade.
+glm::dvec3 RayTracer::shadeHit(ray& r, isect& i, bool hit, const glm::dvec3& thresh,
+                               int depth, double& t, const glm::dvec3* shadows)
+{
+	glm::dvec3 colorC;
+	if(hit) {
 		// An intersection occurred!  We've got work to do.  For now,
 		// this code gets the material for the surface that was intersected,
 		// and asks that material to provide a color for the ray.
@@ -124,7 +237,7 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 		
 		const Material& m = i.getMaterial();
 
-		colorC = m.shade(scene.get(), r, i);
+		colorC = m.shade(scene.get(), r, i, shadows);
 		glm::dvec3 normal = i.getN(); 
 
 		t += i.getT();
@@ -133,9 +246,11 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 
 		//reflection
 		//wanna use an outgoing ray
-		ray reflectray(r.at(i), glm::dvec3(0,0,0), glm::dvec3(1,1,1), ray::REFLECTION);
+		ray reflectray(r.at(i), glm::dvec3(0,0,0), glm::dvec3(1,1,1), ray::REFLECTION, r.getDepth() + 1);
 		glm::dvec3 reflectDir = r.getDirection() - (2.0 * glm::dot(i.getN(), r.getDirection()) * i.getN());
 		reflectray.setDirection(reflectDir);
+		// as if the surface were flat: the bundle keeps spreading as fast
+		reflectray.setFootprint(r.footprintAt(i.getT()), r.getSpread());
 
 		colorC += m.kr(i) * traceRay(reflectray, thresh, depth - 1, t);
 
@@ -169,7 +284,8 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 		if(k >= 0){
 			if(glm::all(glm::greaterThan(trans, zero))){
 				glm::dvec3 refractDir = (((etaR * glm::dot(i.getN(), incident)) - glm::sqrt(k)) * i.getN()) - (etaR * incident);
-				ray refractray(r.at(i), refractDir, glm::dvec3(1,1,1), ray::REFRACTION);
+				ray refractray(r.at(i), refractDir, glm::dvec3(1,1,1), ray::REFRACTION, r.getDepth() + 1);
+				refractray.setFootprint(r.footprintAt(i.getT()), r.getSpread());
 				colorC += trans * traceRay(refractray, thresh, depth - 1, t);
 			}
 		}
@@ -201,12 +317,16 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 }
 
 RayTracer::RayTracer()
-	: scene(nullptr), buffer(0), thresh(0), buffer_width(0), buffer_height(0), m_bBufferReady(false)
+	: stopTrace(false), buffer(0), buffer_width(0), buffer_height(0), thresh(0),
+	  packets(false), pixelSpread(0), pixelOrder(TraceUI::SCANLINE), scene(nullptr), async(false),
+	  tilesTraced(0), tileKdNodes(0), tileKdColdNodes(0), m_bBufferReady(false)
 {
 }
 
 RayTracer::~RayTracer()
 {
+	stopTrace = true;
+	waitRender();
 }
 
 void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
@@ -223,7 +343,10 @@ double RayTracer::aspectRatio()
 
 bool RayTracer::loadScene(const char* fn)
 {
-	
+	// The workers must be done with the old scene before it goes away.
+	stopTrace = true;
+	waitRender();
+
 	ifstream ifs(fn);
 	if( !ifs ) {
 		string msg( "Error: couldn't read scene file " );
@@ -267,10 +390,31 @@ bool RayTracer::loadScene(const char* fn)
 	// kdTree = kdTree->buildKdTree();
 
 	//assert(0);
-	Node* rootNode;
-	rootNode = buildKdTree(scene->getObjects(), scene->bounds(), traceUI->getMaxDepth(), traceUI->getLeafSize());
-	rootNode->isRoot = true;
-	scene->setKd(rootNode);
+	// With a cache directory, a scene that has been built before with the
+	// same settings is mapped back in rather than built again.
+	string cache;
+	if (traceUI->getAccel() == TraceUI::KD_TREE && !traceUI->getAccelCache().empty())
+		cache = KdTree::cacheFile(traceUI->getAccelCache(), fn, traceUI->getMaxDepth(), traceUI->getLeafSize());
+
+	// Objects with an accelerator of their own, the meshes, build it now
+	// rather than make the first ray to reach them wait; each kd-tree
+	// is cached in a file of its own.
+	std::vector<Geometry*> objects = scene->getObjects();
+	for (size_t k = 0; k < objects.size(); k++)
+		objects[k]->buildAccel(cache.empty() ? cache : KdTree::partCacheFile(cache, k));
+
+	switch (traceUI->getAccel()) {
+	case TraceUI::KD_TREE:
+		scene->setKd(KdTree::cached(cache, objects, scene->bounds(), traceUI->getMaxDepth(),
+		                            traceUI->getLeafSize(), traceUI->getThreads(),
+		                            traceUI->singlePrecision()));
+		break;
+	case TraceUI::BVH:
+		scene->setBvh(new Bvh(objects, traceUI->getLeafSize()));
+		break;
+	case TraceUI::BRUTE_FORCE:
+		break;
+	}
 
 	return true;
 }
@@ -291,11 +435,15 @@ void RayTracer::traceSetup(int w, int h)
 	 * Sync with TraceUI
 	 */
 
-	threads = traceUI->getThreads();
-	block_size = traceUI->getBlockSize();
+	threads = std::min(std::max(traceUI->getThreads(), 1), MAX_THREADS);
+	block_size = std::max(traceUI->getBlockSize(), 1);
 	thresh = traceUI->getThreshold();
-	samples = traceUI->getSuperSamples();
+	samples = std::max(traceUI->getSuperSamples(), 1);
 	aaThresh = traceUI->getAaThreshold();
+	pixelOrder = traceUI->getPixelOrder();
+	// the debugging view wants to see every ray on its own
+	packets = traceUI->packetSwitch() && !TraceUI::m_debug;
+	pixelSpread = sceneLoaded() ? glm::length(scene->getCamera().getU()) / w : 0.0;
 
 	// You can add additional GUI functionality here as necessary
 }
@@ -312,24 +460,321 @@ void RayTracer::traceSetup(int w, int h)
  */
 void RayTracer::traceImage(int w, int h)
 {
+	// Abort whatever is still in flight, the buffer is about to be reset.
+	stopTrace = true;
+	waitRender();
+	stopTrace = false;
+
 	// Always call traceSetup before rendering anything.
 	traceSetup(w,h);
-	for (int i = 0; i < w; i++){
-		for (int j = 0; j < h; j++){
+
+	// Only now that the old render's workers are done can its counts be
+	// thrown away.
+	TraceUI::resetCount();
+	tilesTraced = 0;
+	tileKdNodes = 0;
+	tileKdColdNodes = 0;
+
+	runTiles(imageTiles(), [this](const Tile& tile) { traceTile(tile); });
+}
+
+/*
+ * RayTracer::aaImage
+ *
+ *	Antialias the image left in the buffer by traceImage.  Every pixel
+ *	whose color differs from one of its neighbours by at least aaThresh
+ *	is traced again with samples x samples rays; all the others keep
+ *	their single sample.
+ *
+ */
+void RayTracer::aaImage()
+{
+	waitRender();
+	if (stopTrace || !sceneLoaded() || buffer.empty())
+		return;
+
+	// Judge contrast on a copy so that the tiles being supersampled do
+	// not change what their neighbours see.
+	aaBase = buffer;
+	runTiles(imageTiles(), [this](const Tile& tile) { aaTile(tile); });
+}
+
+namespace {
+
+// Position of (x, y) along a Z-order curve: the bits of x and y interleaved.
+unsigned long long mortonKey(unsigned int x, unsigned int y)
+{
+	unsigned long long key = 0;
+	for (int b = 0; b < 32; b++) {
+		key |= (unsigned long long)((x >> b) & 1) << (2 * b);
+		key |= (unsigned long long)((y >> b) & 1) << (2 * b + 1);
+	}
+	return key;
+}
+
+// Position of (x, y) along the Hilbert curve filling an n x n grid, n a
+// power of two.
+unsigned long long hilbertKey(unsigned int n, unsigned int x, unsigned int y)
+{
+	unsigned long long key = 0;
+	for (unsigned int s = n / 2; s > 0; s /= 2) {
+		unsigned int rx = (x & s) ? 1 : 0;
+		unsigned int ry = (y & s) ? 1 : 0;
+		key += (unsigned long long)s * s * ((3 * rx) ^ ry);
+		// Rotate the quadrant so the curve inside it lines up.
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - (x & (s - 1));
+				y = s - 1 - (y & (s - 1));
+			}
+			std::swap(x, y);
+		}
+	}
+	return key;
+}
+
+} // anonymous namespace
+
+// Cut the image into block_size x block_size tiles; the last row and
+// column of tiles are clipped to the image.  The tiles come back in
+// pixelOrder, so that consecutive tiles, and the contiguous runs the pool
+// deals to each worker, cover neighbouring parts of the scene.
+std::vector<Tile> RayTracer::imageTiles() const
+{
+	int cols = (buffer_width + block_size - 1) / block_size;
+	int rows = (buffer_height + block_size - 1) / block_size;
+	unsigned int n = 1;
+	while (n < (unsigned int)std::max(cols, rows))
+		n *= 2;
+
+	std::vector<std::pair<unsigned long long, Tile>> keyed;
+	for (int ty = 0; ty < rows; ty++) {
+		for (int tx = 0; tx < cols; tx++) {
+			int x = tx * block_size;
+			int y = ty * block_size;
+			unsigned long long key;
+			switch (pixelOrder) {
+			case TraceUI::MORTON:
+				key = mortonKey(tx, ty);
+				break;
+			case TraceUI::HILBERT:
+				key = hilbertKey(n, tx, ty);
+				break;
+			default:
+				key = (unsigned long long)ty * cols + tx;
+				break;
+			}
+			keyed.push_back({ key, { x, y, std::min(block_size, buffer_width - x),
+			                         std::min(block_size, buffer_height - y) } });
+		}
+	}
+	std::sort(keyed.begin(), keyed.end(),
+	          [](const std::pair<unsigned long long, Tile>& a,
+	             const std::pair<unsigned long long, Tile>& b) { return a.first < b.first; });
+
+	std::vector<Tile> tiles;
+	tiles.reserve(keyed.size());
+	for (const auto& k : keyed)
+		tiles.push_back(k.second);
+	return tiles;
+}
+
+void RayTracer::traceTile(const Tile& tile)
+{
+	if (thresh > 0) {
+		interpolateTile(tile);
+		return;
+	}
+	if (packets) {
+		tracePacketTile(tile);
+		return;
+	}
+
+	for (int j = tile.y; j < tile.y + tile.h; j++) {
+		for (int i = tile.x; i < tile.x + tile.w; i++) {
 			tracePixel(i, j);
 		}
 	}
-	// YOUR CODE HERE
-	// FIXME: Start one or more threads for ray tracing. 
-	// OpenMP is probably best "bang for buck" time spent on this task
-	//
-	// Alternatively traceImage can be executed asynchronously,
-	//       i.e. returns IMMEDIATELY after working threads are launched.
-	//
-	//       An asynchronous traceImage lets the GUI update your results
-	//       while rendering.
-	//
-	// This will require you to work with pthreads and queuing which is more involved, though
+}
+
+// Trace the tile PACKET_W x PACKET_H pixels at a time.
+void RayTracer::tracePacketTile(const Tile& tile)
+{
+	double x[PACKET_SIZE], y[PACKET_SIZE];
+	int px[PACKET_SIZE], py[PACKET_SIZE];
+	glm::dvec3 colors[PACKET_SIZE];
+
+	for (int j = tile.y; j < tile.y + tile.h; j += PACKET_H) {
+		for (int i = tile.x; i < tile.x + tile.w; i += PACKET_W) {
+			int n = 0;
+			for (int b = j; b < std::min(j + PACKET_H, tile.y + tile.h); b++) {
+				for (int a = i; a < std::min(i + PACKET_W, tile.x + tile.w); a++) {
+					px[n] = a;
+					py[n] = b;
+					x[n] = double(a)/double(buffer_width);
+					y[n] = double(b)/double(buffer_height);
+					n++;
+				}
+			}
+			tracePacket(n, x, y, colors);
+			for (int k = 0; k < n; k++)
+				setPixel(px[k], py[k], colors[k]);
+		}
+	}
+}
+
+// Colors traced so far inside the tile being interpolated.  Interpolated
+// pixels are never marked, so a neighbouring block that is subdivided
+// later may still replace them with traced ones, never the reverse.
+struct RayTracer::BlockSamples {
+	Tile tile;
+	std::vector<glm::dvec3> color;
+	std::vector<char> traced;
+
+	explicit BlockSamples(const Tile& t)
+		: tile(t), color(t.w * t.h), traced(t.w * t.h, 0) {}
+
+	int index(int i, int j) const { return (i - tile.x) + (j - tile.y) * tile.w; }
+};
+
+// Block interpolation mode, enabled by a non-zero threshold: trace the
+// corners of the tile and only trace inside it where they disagree.
+void RayTracer::interpolateTile(const Tile& tile)
+{
+	BlockSamples block(tile);
+	interpolateBlock(block, tile.x, tile.y, tile.x + tile.w - 1, tile.y + tile.h - 1);
+}
+
+void RayTracer::interpolateBlock(BlockSamples& block, int x0, int y0, int x1, int y1)
+{
+	auto sample = [&](int i, int j) -> const glm::dvec3& {
+		int k = block.index(i, j);
+		if (!block.traced[k]) {
+			block.color[k] = tracePixel(i, j);
+			block.traced[k] = 1;
+		}
+		return block.color[k];
+	};
+
+	glm::dvec3 c00 = sample(x0, y0);
+	glm::dvec3 c10 = sample(x1, y0);
+	glm::dvec3 c01 = sample(x0, y1);
+	glm::dvec3 c11 = sample(x1, y1);
+
+	// Nothing left between the corners.
+	if (x1 - x0 <= 1 && y1 - y0 <= 1)
+		return;
+
+	glm::dvec3 lo = glm::min(glm::min(c00, c10), glm::min(c01, c11));
+	glm::dvec3 hi = glm::max(glm::max(c00, c10), glm::max(c01, c11));
+	glm::dvec3 spread = hi - lo;
+	if (std::max(spread[0], std::max(spread[1], spread[2])) <= thresh) {
+		// Smooth enough; fill in bilinearly between the corners.
+		for (int j = y0; j <= y1; j++) {
+			double v = y1 > y0 ? double(j - y0) / (y1 - y0) : 0.0;
+			for (int i = x0; i <= x1; i++) {
+				if (block.traced[block.index(i, j)])
+					continue;
+				double u = x1 > x0 ? double(i - x0) / (x1 - x0) : 0.0;
+				setPixel(i, j, (1 - v) * ((1 - u) * c00 + u * c10) +
+				                v * ((1 - u) * c01 + u * c11));
+			}
+		}
+		return;
+	}
+
+	// Split every side that still has pixels between its ends.
+	int xs[3] = { x0, (x0 + x1) / 2, x1 };
+	int ys[3] = { y0, (y0 + y1) / 2, y1 };
+	int nx = x1 - x0 > 1 ? 2 : 1;
+	int ny = y1 - y0 > 1 ? 2 : 1;
+	if (nx == 1) xs[1] = x1;
+	if (ny == 1) ys[1] = y1;
+	for (int b = 0; b < ny; b++)
+		for (int a = 0; a < nx; a++)
+			interpolateBlock(block, xs[a], ys[b], xs[a + 1], ys[b + 1]);
+}
+
+void RayTracer::aaTile(const Tile& tile)
+{
+	for (int j = tile.y; j < tile.y + tile.h; j++) {
+		for (int i = tile.x; i < tile.x + tile.w; i++) {
+			if (aaContrast(i, j) >= aaThresh)
+				setPixel(i, j, supersample(i, j));
+		}
+	}
+}
+
+// Largest per-channel difference between pixel(i,j) and its four
+// neighbours in the single-sample image, in [0,1].
+double RayTracer::aaContrast(int i, int j) const
+{
+	const unsigned char* p = aaBase.data() + ( i + j * buffer_width ) * 3;
+	int diff = 0;
+	auto compare = [&](int x, int y) {
+		const unsigned char* q = aaBase.data() + ( x + y * buffer_width ) * 3;
+		for (int c = 0; c < 3; c++)
+			diff = std::max(diff, std::abs(int(p[c]) - int(q[c])));
+	};
+	if (i > 0) compare(i - 1, j);
+	if (i < buffer_width - 1) compare(i + 1, j);
+	if (j > 0) compare(i, j - 1);
+	if (j < buffer_height - 1) compare(i, j + 1);
+	return diff / 255.0;
+}
+
+// Run job over every tile and publish each one to the finished queue once
+// it is done.  Synchronous single-threaded renders stay on the calling
+// thread; everything else goes to the persistent worker pool, and in
+// asynchronous mode we return without waiting for it.
+void RayTracer::runTiles(const std::vector<Tile>& tiles, const ThreadPool::Job& job)
+{
+	waitRender();
+	finished.reset(tiles.size());
+
+	ThreadPool::Job publish = [this, job](const Tile& tile) {
+		if (stopTrace)
+			return;
+#ifdef RT_STATS
+		unsigned long long touched = kdNodeCounter.touched;
+		unsigned long long cold = kdNodeCounter.cold;
+		job(tile);
+		tileKdNodes += kdNodeCounter.touched - touched;
+		tileKdColdNodes += kdNodeCounter.cold - cold;
+#else
+		job(tile);
+#endif
+		tilesTraced++;
+		finished.push(tile);
+	};
+
+	if (threads <= 1 && !async) {
+		for (const Tile& tile : tiles)
+			publish(tile);
+		return;
+	}
+
+	if (!pool || pool->size() != threads)
+		pool.reset(new ThreadPool(threads));
+	pool->start(tiles, publish);
+	if (!async)
+		pool->wait();
+}
+
+RayTracer::TileStats RayTracer::getTileStats() const
+{
+	return { tilesTraced, tileKdNodes, tileKdColdNodes };
+}
+
+bool RayTracer::checkRender()
+{
+	return pool && !pool->idle();
+}
+
+void RayTracer::waitRender()
+{
+	if (pool)
+		pool->wait();
 }
 
 
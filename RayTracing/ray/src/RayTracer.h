@@ -11,6 +11,9 @@
 #include <thread>
 #include "scene/cubeMap.h"
 #include "scene/ray.h"
+#include "ThreadPool.h"
+#include "ui/TraceUI.h"
+#include <atomic>
 #include <mutex>
 
 class Scene;
@@ -39,6 +42,15 @@ public:
 	double aspectRatio();
 
 	void traceImage(int w, int h);
+	void aaImage();
+
+	// In asynchronous mode traceImage returns as soon as the tiles have
+	// been handed to the workers.  Poll checkRender to see whether they
+	// are still going and nextFinishedTile to pick up finished regions.
+	void setAsync(bool a) { async = a; }
+	bool checkRender();
+	void waitRender();
+	bool nextFinishedTile(Tile& tile) { return finished.pop(tile); }
 
 	void traceSetup(int w, int h);
 
@@ -50,12 +62,36 @@ public:
 
 	const Scene& getScene() { return *scene; }
 
-	bool stopTrace;
+	// Totals over the tiles traced since the last traceImage.
+	struct TileStats {
+		unsigned long long tiles;
+		unsigned long long kdNodes;     // kd-tree nodes visited
+		unsigned long long kdColdNodes; // ...that the thread had not visited lately
+	};
+	TileStats getTileStats() const;
+
+	// Checked before every tile; setting it aborts the current render.
+	std::atomic<bool> stopTrace;
 
 private:
 	glm::dvec3 trace(double x, double y);
+	void tracePacket(int n, const double* x, const double* y, glm::dvec3* colors);
+	glm::dvec3 shadeHit(ray& r, isect& i, bool hit, const glm::dvec3& thresh,
+	                    int depth, double& t, const glm::dvec3* shadows);
+	glm::dvec3 supersample(int i, int j);
+	double aaContrast(int i, int j) const;
+	std::vector<Tile> imageTiles() const;
+	void traceTile(const Tile& tile);
+	void tracePacketTile(const Tile& tile);
+	void aaTile(const Tile& tile);
+
+	struct BlockSamples;
+	void interpolateTile(const Tile& tile);
+	void interpolateBlock(BlockSamples& block, int x0, int y0, int x1, int y1);
+	void runTiles(const std::vector<Tile>& tiles, const ThreadPool::Job& job);
 
 	std::vector<unsigned char> buffer;
+	std::vector<unsigned char> aaBase; // one sample per pixel, for aaImage
 	int buffer_width, buffer_height;
 	int bufferSize;
 	unsigned int threads;
@@ -63,7 +99,17 @@ private:
 	double thresh;
 	double aaThresh;
 	int samples;
+	bool packets;
+	double pixelSpread; // a pixel's width at unit distance from the eye
+	TraceUI::PixelOrder pixelOrder;
 	std::unique_ptr<Scene> scene;
+	std::unique_ptr<ThreadPool> pool;
+	TileQueue finished;
+	bool async;
+
+	std::atomic<unsigned long long> tilesTraced;
+	std::atomic<unsigned long long> tileKdNodes;
+	std::atomic<unsigned long long> tileKdColdNodes;
 
 	bool m_bBufferReady;
 
@@ -13,6 +13,12 @@ bool Box::intersectLocal(ray& r, isect& i) const
         glm::dvec3 p = r.getPosition();
         glm::dvec3 d = r.getDirection();
 //        d.normalize();
+        if (worldSpace) {
+                // Into the unit box without a matrix; d is not normalized,
+                // so t comes out the same as in world space.
+                p = (p - center) / size;
+                d = d / size;
+        }
 
         int it;
         double x, y, t, bestT; 
@@ -54,10 +60,9 @@ bool Box::intersectLocal(ray& r, isect& i) const
         
         i.setT(bestT);
         i.setObject(this);
-		i.setMaterial(this->getMaterial());
 
 		//glm::dvec3 intersect_point = r.at((float)i.t);
-		glm::dvec3 intersect_point = r.at(i);
+		glm::dvec3 intersect_point = p + bestT * d;
 
 		int i1 = (bestIndex + 1) % 3;
 		int i2 = (bestIndex + 2) % 3;
@@ -75,5 +80,19 @@ bool Box::intersectLocal(ray& r, isect& i) const
 											0.5 + intersect_point[ max(i1, i2) ] ) );
 
 		}
+		// d is in unit box lengths per unit of t
+		i.setUVScale( glm::length(d) );
         return true;
 }
+
+// A box that is only scaled and moved stays a box along the axes, so all
+// it needs is its center and size.
+void Box::bakeTransform()
+{
+	if (!transform->axisAligned())
+		return;
+	const glm::dmat4x4& m = transform->transform();
+	center = glm::dvec3(m[3]);
+	size = glm::dvec3(m[0][0], m[1][1], m[2][2]);
+	worldSpace = true;
+}
@@ -11,6 +11,7 @@ public:
 	}
 
 	virtual bool intersectLocal(ray& r, isect& i ) const;
+	virtual void bakeTransform();
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
@@ -23,6 +24,10 @@ public:
 
 protected:
 	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
+
+	// the box in world space, once baked
+	glm::dvec3 center;
+	glm::dvec3 size;
 };
 
 #endif // __BOX_H__
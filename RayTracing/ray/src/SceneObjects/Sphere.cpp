@@ -8,6 +8,16 @@ using namespace std;
 
 bool Sphere::intersectLocal(ray& r, isect& i) const
 {
+	if (worldSpace) {
+		double t;
+		if (!worldRoot(r, t))
+			return false;
+		i.setObject(this);
+		i.setT(t);
+		i.setN(glm::normalize(r.at(t) - center));
+		return true;
+	}
+
 	r.setDirection(glm::normalize(r.getDirection()));
 	glm::dvec3 v = -r.getPosition();
 	double b = glm::dot(v, r.getDirection());
@@ -25,7 +35,6 @@ bool Sphere::intersectLocal(ray& r, isect& i) const
 	}
 
 	i.setObject(this);
-	i.setMaterial(this->getMaterial());
 
 	double t1 = b - discriminant;
 
@@ -40,3 +49,67 @@ bool Sphere::intersectLocal(ray& r, isect& i) const
 	return true;
 }
 
+bool Sphere::occludesLocal(ray& r, double tmax) const
+{
+	if (worldSpace) {
+		double t;
+		return worldRoot(r, t) && t < tmax;
+	}
+
+	r.setDirection(glm::normalize(r.getDirection()));
+	glm::dvec3 v = -r.getPosition();
+	double b = glm::dot(v, r.getDirection());
+	double discriminant = b*b - glm::dot(v,v) + 1;
+
+	if( discriminant < 0.0 ) {
+		return false;
+	}
+
+	discriminant = sqrt( discriminant );
+	double t2 = b + discriminant;
+
+	if( t2 <= RAY_EPSILON ) {
+		return false;
+	}
+
+	double t1 = b - discriminant;
+	return (t1 > RAY_EPSILON ? t1 : t2) < tmax;
+}
+
+// Rotating, moving and evenly scaling a sphere leaves a sphere, which is
+// all its center and radius.
+void Sphere::bakeTransform()
+{
+	double scale = transform->uniformScale();
+	if (scale <= 0.0)
+		return;
+	center = transform->localToGlobalCoords(glm::dvec3(0.0, 0.0, 0.0));
+	radius = scale;
+	worldSpace = true;
+}
+
+// The first t past RAY_EPSILON at which r meets the baked sphere.  The
+// world ray's direction need not be of unit length.
+bool Sphere::worldRoot(const ray& r, double& t) const
+{
+	glm::dvec3 d = r.getDirection();
+	glm::dvec3 v = center - r.getPosition();
+	double a = glm::dot(d, d);
+	double b = glm::dot(v, d);
+	double discriminant = b*b - a * (glm::dot(v,v) - radius*radius);
+
+	if( discriminant < 0.0 ) {
+		return false;
+	}
+
+	discriminant = sqrt( discriminant );
+	double t2 = (b + discriminant) / a;
+
+	if( t2 <= RAY_EPSILON ) {
+		return false;
+	}
+
+	double t1 = (b - discriminant) / a;
+	t = t1 > RAY_EPSILON ? t1 : t2;
+	return true;
+}
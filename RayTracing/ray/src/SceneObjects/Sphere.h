@@ -13,6 +13,8 @@ public:
 	}
     
 	virtual bool intersectLocal(ray& r, isect& i ) const;
+	virtual bool occludesLocal(ray& r, double tmax) const;
+	virtual void bakeTransform();
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
     virtual BoundingBox ComputeLocalBoundingBox()
@@ -25,5 +27,11 @@ public:
 
 protected:
 	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
+
+	bool worldRoot(const ray& r, double& t) const;
+
+	// the sphere in world space, once baked
+	glm::dvec3 center;
+	double radius = 1.0;
 };
 #endif // __SPHERE_H__
@@ -32,7 +32,6 @@ bool Square::intersectLocal(ray& r, isect& i) const
 	}
 
 	i.setObject(this);
-	i.setMaterial(this->getMaterial());
 	i.setT(t);
 	if( d[2] > 0.0 ) {
 		i.setN(glm::dvec3( 0.0, 0.0, -1.0 ));
@@ -41,5 +40,25 @@ bool Square::intersectLocal(ray& r, isect& i) const
 	}
 
 	i.setUVCoordinates( glm::dvec2(P[0] + 0.5, P[1] + 0.5) );
+	i.setUVScale( 1.0 );
 	return true;
 }
+
+bool Square::occludesLocal(ray& r, double tmax) const
+{
+	glm::dvec3 p = r.getPosition();
+	glm::dvec3 d = r.getDirection();
+
+	if( d[2] == 0.0 ) {
+		return false;
+	}
+
+	double t = -p[2]/d[2];
+
+	if( t <= RAY_EPSILON || !(t < tmax) ) {
+		return false;
+	}
+
+	glm::dvec3 P = r.at( t );
+	return P[0] >= -0.5 && P[0] <= 0.5 && P[1] >= -0.5 && P[1] <= 0.5;
+}
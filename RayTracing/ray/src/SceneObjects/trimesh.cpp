@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <cmath>
 #include "../ui/TraceUI.h"
+#include "../scene/triangles.h"
 extern TraceUI* traceUI;
 
 using namespace std;
@@ -66,8 +67,28 @@ const char* Trimesh::doubleCheck()
 	return 0;
 }
 
+static BoundingBox boxAround(const std::vector<glm::dvec3>& verts)
+{
+	BoundingBox box;
+	if (verts.empty())
+		return box;
+	box.setMin(verts[0]);
+	box.setMax(verts[0]);
+	for (const auto& v : verts) {
+		box.setMin(glm::min(box.getMin(), v));
+		box.setMax(glm::max(box.getMax(), v));
+	}
+	return box;
+}
+
+// The face the mesh's accelerator finds is left for Scene::intersect() (or
+// the instance) to resolve, as a face found by the scene's would be.
 bool Trimesh::intersectLocal(ray& r, isect& i) const
 {
+	if (kdtree)
+		return kdtree->intersect(r, i);
+	if (bvh)
+		return bvh->intersect(r, i);
 	bool have_one = false;
 	for (auto face : faces) {
 		isect cur;
@@ -78,98 +99,199 @@ bool Trimesh::intersectLocal(ray& r, isect& i) const
 			}
 		}
 	}
-	if (!have_one)
-		i.setT(1000.0);
 	return have_one;
 }
 
-bool TrimeshFace::intersect(ray& r, isect& i) const
+bool Trimesh::occludesLocal(ray& r, double tmax) const
+{
+	if (kdtree)
+		return kdtree->occluded(r, tmax);
+	if (bvh)
+		return bvh->occluded(r, tmax);
+	for (auto face : faces)
+		if (face->occludesLocal(r, tmax))
+			return true;
+	return false;
+}
+
+// Instances of a named mesh all call this; the first one builds.  The
+// tree is built in the space the faces are tested in.
+void Trimesh::buildAccel(const std::string& cache)
+{
+	if (accelBuilt)
+		return;
+	accelBuilt = true;
+	std::vector<Geometry*> objects(faces.begin(), faces.end());
+	switch (traceUI->getAccel()) {
+	case TraceUI::KD_TREE:
+		kdtree.reset(KdTree::cached(cache, objects, boxAround(worldSpace ? worldVertices : vertices),
+		                            traceUI->getMaxDepth(), traceUI->getLeafSize(),
+		                            traceUI->getThreads(), traceUI->singlePrecision()));
+		break;
+	case TraceUI::BVH:
+		bvh.reset(new Bvh(objects, traceUI->getLeafSize()));
+		break;
+	case TraceUI::BRUTE_FORCE:
+		break;
+	}
+}
+
+// Once baked, the box around the world vertices is tighter than the
+// transformed local one.
+void Trimesh::ComputeBoundingBox()
+{
+	if (!worldSpace || worldVertices.empty()) {
+		Geometry::ComputeBoundingBox();
+		return;
+	}
+	bounds = boxAround(worldVertices);
+}
+
+// The face the mesh finds is kept as the hit's part, unresolved, like any
+// other candidate; only the closest one is finished, by resolveHit().
+bool TrimeshInstance::intersectLocal(ray& r, isect& i) const
+{
+	if (!mesh->intersectLocal(r, i))
+		return false;
+	i.setPart(i.getObject());
+	i.setObject(this);
+	return true;
+}
+
+// r is the world ray, and the face works in the mesh's space, where its
+// transform is the identity; so take r there, as intersect() did to find
+// the hit, and bring the normal back.  A per-vertex material stays in i
+// and wins over the instance's.
+void TrimeshInstance::resolveHit(const ray& r, isect& i) const
+{
+	glm::dvec3 pos = transform->globalToLocalCoords(r.getPosition());
+	glm::dvec3 dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
+	double length = glm::length(dir);
+	ray local(r);
+	local.setPosition(pos);
+	local.setDirection(glm::normalize(dir));
+	i.getPart()->resolveHit(local, i);
+	i.setN(transform->localToGlobalCoordsNormal(i.getN()));
+	i.setUVScale(i.getUVScale() * length);
+}
+
+bool TrimeshInstance::occludesLocal(ray& r, double tmax) const
+{
+	return mesh->occludesLocal(r, tmax);
+}
+
+// Any transform takes triangles to triangles, so a mesh always works in
+// world space.
+void Trimesh::bakeTransform()
 {
-	return intersectLocal(r, i);
+	if (worldSpace && worldVertices.size() == vertices.size())
+		return;
+	worldVertices.clear();
+	for (const auto& v : vertices)
+		worldVertices.push_back(transform->localToGlobalCoords(v));
+	worldSpace = true;
+	for (auto face : faces)
+		face->bakeTransform();
+}
+
+void TrimeshFace::bakeTransform()
+{
+	parent->bakeTransform();
+	worldSpace = true;
+	bounds = BoundingBox(glm::min(corner(0), glm::min(corner(1), corner(2))),
+	                     glm::max(corner(0), glm::max(corner(1), corner(2))));
 }
 
 // Intersect ray r with the triangle abc.  If it hits returns true,
 // and put the parameter in t and the barycentric coordinates of the
-// intersection in u (alpha) and v (beta).
+// intersection in u (alpha) and v (beta).  The normal and material
+// wait for resolveHit(), as most of these hits never get that far.
 bool TrimeshFace::intersectLocal(ray& r, isect& i) const
 {
+	const glm::dvec3& a_coord = corner(0);
+	double t, u, v;
+	if (!intersectTriangle(r, a_coord, corner(1) - a_coord,
+	                       corner(2) - a_coord, DBL_MAX, t, u, v))
+		return false;
+	setHit(t, u, v, i);
+	return true;
+}
 
-	// FIXME: Add ray-trimesh intersection
-	double tnum = (glm::dot(normal, r.getPosition()) + (-1.0 * dist));
-	double tdenom = (glm::dot(normal, (r.getDirection() * 1.0)));
-	double t = (-1.0 * (tnum / tdenom));
-	if (tdenom == 0 || t < 0){
+bool TrimeshFace::getTriangle(glm::dvec3& a, glm::dvec3& b, glm::dvec3& c) const
+{
+	if (degen)
 		return false;
+	if (worldSpace) {
+		a = corner(0);
+		b = corner(1);
+		c = corner(2);
+	} else {
+		a = transform->localToGlobalCoords(parent->vertices[ids[0]]);
+		b = transform->localToGlobalCoords(parent->vertices[ids[1]]);
+		c = transform->localToGlobalCoords(parent->vertices[ids[2]]);
 	}
-	glm::dvec3 Q = r.getPosition() + (r.getDirection() * t);
-	//Q = r.at(t);
-	glm::dvec3 a_coord = (parent->vertices[ids[0]]);
-	glm::dvec3 b_coord = (parent->vertices[ids[1]]);
-	glm::dvec3 c_coord = (parent->vertices[ids[2]]);
-	glm::dvec3 vaq = (Q - a_coord);
-	glm::dvec3 vbq = (Q - b_coord);
-	glm::dvec3 vcq = (Q - c_coord);
-	glm::dvec3 vca = (a_coord - c_coord);	
-	glm::dvec3 vab = (b_coord - a_coord);
-	glm::dvec3 vac = (c_coord - a_coord);
-	glm::dvec3 vbc = (c_coord - b_coord);
-	glm::dvec3 vqa = (a_coord - Q);
-	glm::dvec3 vqb = (b_coord - Q);
-	glm::dvec3 vqc = (c_coord - Q);
-
-	//do inside/outside tests to see if Q is in tri	
-	double sideOfAB = (glm::dot(normal, glm::cross(vab, vaq))); 
-	double sideOfBC = (glm::dot(normal, glm::cross(vbc, vbq)));
-	double sideOfCA = (glm::dot(normal, glm::cross(vca, vcq)));
-	
-	if ((sideOfAB >= 0) && (sideOfBC >= 0) && (sideOfCA >= 0)){
-		i.setObject(this);
-		i.setT(t);
-		i.setMaterial(this->getMaterial());
-		i.setN(normal);
-		//get areas
-		double abc = (glm::dot(glm::cross(vab, vac), normal));
-		double qbc = (glm::dot(glm::cross(vqb, vqc), normal));
-		double qca = (glm::dot(glm::cross(vqc, vqa), normal));
-		double alpha = (qbc / abc);
-		double beta = (qca / abc);
-		double gamma = 1.0 - alpha - beta;
-		i.setBary(alpha, beta, gamma);
-		i.setUVCoordinates(glm::dvec2(alpha, beta));
-		
-		glm::dvec3 norm;
-		//phong interpolation
-		if (parent->vertNorms){ //normals are per vertex
-			glm::dvec3 avec = (alpha * (parent->normals[ids[0]]));
-			glm::dvec3 bvec = (beta * (parent->normals[ids[1]]));
-			glm::dvec3 cvec = (gamma * (parent->normals[ids[2]]));
-			avec = glm::normalize(avec);
-			bvec = glm::normalize(bvec);
-			cvec = glm::normalize(cvec);
-			norm = (avec + bvec + cvec);
-		} else {
-			norm = glm::dvec3(normal[0] * alpha, normal[1] * beta,
-				normal[2] * gamma);
-			norm = glm::normalize(norm);
-		} 
-		double checkNorm = glm::dot(norm, r.getDirection());
-		double backOfTri = (checkNorm < 0.0) - (checkNorm > 0.0);
-		norm = backOfTri * norm;
-		i.setN(norm);
-
-		//loop through materials & interpolate vals for each one
-		if (parent->materials.size() > 0) {
-			Material sumMat = Material();
-			sumMat = (alpha * *parent->materials[ids[0]]);
-			sumMat += (beta * *parent->materials[ids[1]]);
-			sumMat += (gamma * *parent->materials[ids[2]]);
-			i.setMaterial(sumMat);
-		} else {
-			i.setMaterial(this->getMaterial());
-		}
-		return true;
+	return true;
+}
+
+void TrimeshFace::setTriangleHit(const ray& r, double t, double u, double v, isect& i) const
+{
+	setHit(t, u, v, i);
+}
+
+// u and v are the weights of b and c, so a gets what is left.
+void TrimeshFace::setHit(double t, double u, double v, isect& i) const
+{
+	i.setObject(this);
+	i.setT(t);
+	double alpha = 1.0 - u - v;
+	double beta = u;
+	i.setBary(alpha, beta, v);
+	i.setUVCoordinates(glm::dvec2(alpha, beta));
+	i.clearMaterial();
+}
+
+// The normal, facing back along r, and the material, both interpolated
+// from the weights setHit() left in i.
+void TrimeshFace::resolveHit(const ray& r, isect& i) const
+{
+	glm::dvec3 pos = transform->globalToLocalCoords(r.getPosition());
+	glm::dvec3 dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
+	glm::dvec3 bary = i.getBary();
+	double alpha = bary[0];
+	double beta = bary[1];
+	double gamma = bary[2];
+
+	glm::dvec3 norm;
+	//phong interpolation
+	if (parent->vertNorms){ //normals are per vertex
+		glm::dvec3 avec = (alpha * (parent->normals[ids[0]]));
+		glm::dvec3 bvec = (beta * (parent->normals[ids[1]]));
+		glm::dvec3 cvec = (gamma * (parent->normals[ids[2]]));
+		avec = glm::normalize(avec);
+		bvec = glm::normalize(bvec);
+		cvec = glm::normalize(cvec);
+		norm = (avec + bvec + cvec);
+	} else {
+		norm = glm::dvec3(normal[0] * alpha, normal[1] * beta,
+			normal[2] * gamma);
+		norm = glm::normalize(norm);
+	} 
+	double checkNorm = glm::dot(norm, dir);
+	double backOfTri = (checkNorm < 0.0) - (checkNorm > 0.0);
+	norm = backOfTri * norm;
+	i.setN(transform->localToGlobalCoordsNormal(norm));
+	// The weights run from 0 to 1 across the triangle.
+	i.setUVScale(1.0 / std::sqrt(glm::length(glm::cross(corner(1) - corner(0),
+	                                                    corner(2) - corner(0)))));
+
+	//loop through materials & interpolate vals for each one
+	if (parent->materials.size() > 0) {
+		Material sumMat = Material();
+		sumMat = (alpha * *parent->materials[ids[0]]);
+		sumMat += (beta * *parent->materials[ids[1]]);
+		sumMat += (gamma * *parent->materials[ids[2]]);
+		i.setMaterial(sumMat);
 	}
-	return false;
 }
 
 
@@ -198,3 +320,11 @@ void Trimesh::generateNormals()
 	vertNorms = true;
 }
 
+// The test of intersectLocal alone, for shadow rays.
+bool TrimeshFace::occludesLocal(ray& r, double tmax) const
+{
+	const glm::dvec3& a_coord = corner(0);
+	double t, u, v;
+	return intersectTriangle(r, a_coord, corner(1) - a_coord,
+	                         corner(2) - a_coord, tmax, t, u, v);
+}
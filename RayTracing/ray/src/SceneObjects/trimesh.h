@@ -3,8 +3,10 @@
 
 #include <list>
 #include <memory>
+#include <string>
 #include <vector>
 
+#include "../scene/bvh.h"
 #include "../scene/kdTree.h"
 #include "../scene/material.h"
 #include "../scene/ray.h"
@@ -14,19 +16,28 @@
 #include <glm/vec3.hpp>
 
 class TrimeshFace;
+class TrimeshInstance;
 
 class Trimesh : public MaterialSceneObject {
 	friend class TrimeshFace;
+	friend class TrimeshInstance;
 	typedef std::vector<glm::dvec3> Normals;
 	typedef std::vector<glm::dvec3> Vertices;
 	typedef std::vector<TrimeshFace *> Faces;
 	typedef std::vector<Material *> Materials;
 
 	Vertices vertices;
+	Vertices worldVertices; // vertices under transform, once baked
 	Faces faces;
 	Normals normals;
 	Materials materials;
 	BoundingBox localBounds;
+	// The faces in an accelerator of their own, in the space they are
+	// tested in: the kind the scene uses, or none, and then every face is
+	// tested.  See buildAccel().
+	std::unique_ptr<KdTree> kdtree;
+	std::unique_ptr<Bvh> bvh;
+	bool accelBuilt = false;
 
 public:
 	Trimesh(Scene *scene, Material *mat, TransformNode *transform)
@@ -41,6 +52,10 @@ public:
 	bool vertNorms;
 
 	bool intersectLocal(ray &r, isect &i) const;
+	bool occludesLocal(ray &r, double tmax) const;
+	void bakeTransform();
+	void buildAccel(const std::string &cache);
+	void ComputeBoundingBox();
 
 	~Trimesh();
 
@@ -90,6 +105,14 @@ class TrimeshFace : public MaterialSceneObject {
 	glm::dvec3 normal;
 	double dist;
 
+	void setHit(double t, double u, double v, isect &i) const;
+
+	// corner k in the space intersectLocal() works in
+	const glm::dvec3 &corner(int k) const
+	{
+		return worldSpace ? parent->worldVertices[ids[k]] : parent->vertices[ids[k]];
+	}
+
 public:
 	TrimeshFace(Scene *scene, Material *mat, Trimesh *parent, int a, int b,
 	            int c)
@@ -130,8 +153,13 @@ public:
 
 	glm::dvec3 getNormal() { return normal; }
 
-	bool intersect(ray &r, isect &i) const;
 	bool intersectLocal(ray &r, isect &i) const;
+	bool occludesLocal(ray &r, double tmax) const;
+	void bakeTransform();
+
+	bool getTriangle(glm::dvec3 &a, glm::dvec3 &b, glm::dvec3 &c) const;
+	void setTriangleHit(const ray &r, double t, double u, double v, isect &i) const;
+	void resolveHit(const ray &r, isect &i) const;
 
 	bool hasBoundingBoxCapability() const { return true; }
 
@@ -153,4 +181,40 @@ public:
 	const BoundingBox &getBoundingBox() const { return localbounds; }
 };
 
+// One placement of a named mesh: a transform, and a material if it has
+// one of its own, over faces that stay in the mesh's object space and are
+// shared by every instance.  The scene's tree only sees the instance; the
+// mesh's own accelerator finds the face.
+class TrimeshInstance : public SceneObject {
+public:
+	TrimeshInstance(Scene *scene, Trimesh *mesh, TransformNode *transform,
+	                Material *mat = nullptr)
+	        : SceneObject(scene), mesh(mesh), material(mat)
+	{
+		this->transform = transform;
+	}
+
+	const Material &getMaterial() const
+	{
+		return material ? *material : mesh->getMaterial();
+	}
+	void setMaterial(Material *m) { material.reset(m); }
+
+	bool intersectLocal(ray &r, isect &i) const;
+	bool occludesLocal(ray &r, double tmax) const;
+	void resolveHit(const ray &r, isect &i) const;
+	void buildAccel(const std::string &cache) { mesh->buildAccel(cache); }
+
+	bool hasBoundingBoxCapability() const { return true; }
+	BoundingBox ComputeLocalBoundingBox() { return mesh->ComputeLocalBoundingBox(); }
+
+protected:
+	void glDrawLocal(int quality, bool actualMaterials,
+	                 bool actualTextures) const;
+
+private:
+	Trimesh *mesh;
+	unique_ptr<Material> material;
+};
+
 #endif // TRIMESH_H__
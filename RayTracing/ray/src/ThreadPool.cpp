@@ -0,0 +1,149 @@
+#include "ThreadPool.h"
+#include "scene/ray.h"
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+	: generation(0), shutdown(false), busy(0)
+{
+	if (numThreads < 1)
+		numThreads = 1;
+	for (unsigned int i = 0; i < numThreads; i++)
+		queues.emplace_back(new Queue());
+	for (unsigned int i = 0; i < numThreads; i++)
+		workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(stateLock);
+		shutdown = true;
+	}
+	wakeUp.notify_all();
+	for (auto& w : workers)
+		w.join();
+}
+
+void ThreadPool::start(const std::vector<Tile>& tiles, const Job& j)
+{
+	if (tiles.empty())
+		return;
+
+	std::unique_lock<std::mutex> lock(stateLock);
+	allDone.wait(lock, [this] { return busy == 0; });
+
+	// Deal contiguous runs of tiles so that each worker starts out on
+	// a coherent patch of the image; stealing evens out the rest.
+	size_t n = queues.size();
+	for (size_t q = 0; q < n; q++) {
+		size_t begin = tiles.size() * q / n;
+		size_t end = tiles.size() * (q + 1) / n;
+		std::lock_guard<std::mutex> qlock(queues[q]->lock);
+		queues[q]->tiles.assign(tiles.begin() + begin, tiles.begin() + end);
+	}
+
+	job = j;
+	busy = (unsigned int)workers.size();
+	generation++;
+	wakeUp.notify_all();
+}
+
+void ThreadPool::wait()
+{
+	// A worker only goes idle once every deque is empty, so when all of
+	// them are idle every tile has been traced.
+	std::unique_lock<std::mutex> lock(stateLock);
+	allDone.wait(lock, [this] { return busy == 0; });
+	job = nullptr;
+}
+
+bool ThreadPool::idle()
+{
+	std::lock_guard<std::mutex> lock(stateLock);
+	return busy == 0;
+}
+
+void ThreadPool::workerLoop(unsigned int id)
+{
+	// Give every worker its own slot in the per-thread ray counters.
+	ray_thread_id = id;
+
+	unsigned long seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(stateLock);
+			wakeUp.wait(lock, [&] { return shutdown || generation != seen; });
+			if (shutdown)
+				return;
+			seen = generation;
+		}
+
+		Tile tile;
+		while (popLocal(id, tile) || steal(id, tile))
+			job(tile);
+
+		std::lock_guard<std::mutex> lock(stateLock);
+		if (--busy == 0)
+			allDone.notify_all();
+	}
+}
+
+// The owner walks its own deque front to back so it stays on neighbouring
+// tiles; thieves take from the back, as far away from the owner as possible.
+bool ThreadPool::popLocal(unsigned int id, Tile& tile)
+{
+	Queue& q = *queues[id];
+	std::lock_guard<std::mutex> lock(q.lock);
+	if (q.tiles.empty())
+		return false;
+	tile = q.tiles.front();
+	q.tiles.pop_front();
+	return true;
+}
+
+bool ThreadPool::steal(unsigned int id, Tile& tile)
+{
+	size_t n = queues.size();
+	for (size_t k = 1; k < n; k++) {
+		Queue& q = *queues[(id + k) % n];
+		std::lock_guard<std::mutex> lock(q.lock);
+		if (q.tiles.empty())
+			continue;
+		tile = q.tiles.back();
+		q.tiles.pop_back();
+		return true;
+	}
+	return false;
+}
+
+void TileQueue::reset(size_t n)
+{
+	if (n > capacity) {
+		slots.reset(new Slot[n]);
+		capacity = n;
+	}
+	for (size_t i = 0; i < capacity; i++)
+		slots[i].ready.store(false, std::memory_order_relaxed);
+	tail.store(0, std::memory_order_relaxed);
+	head = 0;
+}
+
+void TileQueue::push(const Tile& tile)
+{
+	size_t i = tail.fetch_add(1, std::memory_order_relaxed);
+	if (i >= capacity)
+		return;
+	slots[i].tile = tile;
+	slots[i].ready.store(true, std::memory_order_release);
+}
+
+// Slots are consumed in the order they were claimed; a producer that has
+// claimed a slot but not yet filled it holds back the ones behind it for
+// the few instructions it takes to finish.
+bool TileQueue::pop(Tile& tile)
+{
+	if (head >= capacity || !slots[head].ready.load(std::memory_order_acquire))
+		return false;
+	tile = slots[head].tile;
+	head++;
+	return true;
+}
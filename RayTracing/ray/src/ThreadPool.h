@@ -0,0 +1,98 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+// A persistent pool of render threads.  Work is handed out as image
+// tiles; every worker owns a deque of tiles, drains it from the front and
+// steals from the back of the other workers' deques once it runs dry.
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A rectangular block of pixels [x, x + w) x [y, y + h).
+struct Tile {
+	int x, y;
+	int w, h;
+};
+
+class ThreadPool {
+public:
+	typedef std::function<void(const Tile&)> Job;
+
+	explicit ThreadPool(unsigned int numThreads);
+	~ThreadPool();
+
+	unsigned int size() const { return (unsigned int)workers.size(); }
+
+	// Deal the tiles out to the workers and return straight away.  A
+	// batch that is still running is waited for first.
+	void start(const std::vector<Tile>& tiles, const Job& job);
+
+	// Block until every tile of the current batch has been handed to job.
+	void wait();
+
+	// True when no batch is running.
+	bool idle();
+
+	void run(const std::vector<Tile>& tiles, const Job& job)
+	{
+		start(tiles, job);
+		wait();
+	}
+
+private:
+	struct Queue {
+		std::mutex lock;
+		std::deque<Tile> tiles;
+	};
+
+	void workerLoop(unsigned int id);
+	bool popLocal(unsigned int id, Tile& tile);
+	bool steal(unsigned int id, Tile& tile);
+
+	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<Queue>> queues;
+
+	std::mutex stateLock;
+	std::condition_variable wakeUp;
+	std::condition_variable allDone;
+	unsigned long generation;
+	bool shutdown;
+	unsigned int busy; // workers still draining the current batch
+
+	Job job;
+};
+
+// Finished tiles on their way from the workers to whoever displays them.
+// Any number of threads may push, a single thread pops.  Each tile of a
+// frame is pushed exactly once, so a frame never needs more slots than it
+// has tiles and the queue does not have to wrap around.
+class TileQueue {
+public:
+	TileQueue() : capacity(0), tail(0), head(0) {}
+
+	// Make room for capacity tiles and drop anything left over.  Must not
+	// race with push or pop.
+	void reset(size_t capacity);
+
+	void push(const Tile& tile);
+	bool pop(Tile& tile);
+
+private:
+	struct Slot {
+		Tile tile;
+		std::atomic<bool> ready;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	size_t capacity;
+	std::atomic<size_t> tail; // next slot handed to a producer
+	size_t head;              // next slot the consumer looks at
+};
+
+#endif // __THREADPOOL_H__
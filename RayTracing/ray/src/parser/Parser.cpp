@@ -53,6 +53,7 @@ Scene* Parser::parseScene()
       case CYLINDER:
       case CONE:
       case TRIMESH:
+      case INSTANCE:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -166,6 +167,7 @@ void Parser::parseTransformableElement( Scene* scene, TransformNode* transform,
       case CYLINDER:
       case CONE:
       case TRIMESH:
+      case INSTANCE:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -196,6 +198,7 @@ void Parser::parseGroup(Scene* scene, TransformNode* transform, const Material&
       case CYLINDER:
       case CONE:
       case TRIMESH:
+      case INSTANCE:
       case TRANSLATE:
       case ROTATE:
       case SCALE:
@@ -241,6 +244,9 @@ void Parser::parseGeometry(Scene* scene, TransformNode* transform, const Materia
     case TRIMESH:
       parseTrimesh(scene, transform, mat);
       return;
+    case INSTANCE:
+      parseInstance(scene, transform, mat);
+      return;
     case TRANSLATE:
       parseTranslate(scene, transform, mat);
       return;
@@ -556,7 +562,9 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   _tokenizer.Read( LBRACE );
 
   bool generateNormals( false );
+  bool instanced( false );
   list<glm::dvec3> faces;
+  string name;
 
   const char* error;
   for( ;; )
@@ -571,12 +579,18 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         generateNormals = true;
         break;
 
+      case INSTANCED:
+        _tokenizer.Read( INSTANCED );
+        _tokenizer.Read( SEMICOLON );
+        instanced = true;
+        break;
+
       case MATERIAL:
         tmesh->setMaterial( parseMaterialExpression( scene, mat ) );
         break;
 
       case NAME:
-         parseIdentExpression();
+         name = parseIdentExpression();
          break;
 
       case MATERIALS:
@@ -665,6 +679,20 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
       {
         _tokenizer.Read( RBRACE );
 
+        // An instanced mesh keeps its faces in object space, out of the
+        // scene, and goes in as an instance here and wherever an instance
+        // names it.  Any other mesh's name is ignored, as it always was.
+        if( instanced )
+        {
+          if( name.empty() || meshes.count( name ) )
+          {
+            delete tmesh;
+            throw ParserException( name.empty() ? "An instanced trimesh needs a name"
+                                                : "Trimesh '" + name + "' is already defined" );
+          }
+          tmesh->setTransform( &scene->transformRoot );
+        }
+
         // Now add all the faces into the trimesh, since hopefully
         // the vertices have been parsed out
         for( list<glm::dvec3>::const_iterator vitr = faces.begin(); vitr != faces.end(); vitr++ )
@@ -676,20 +704,24 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
               ", " << (*vitr)[2] << ")";
             throw ParserException( oss.str() );
           }
-          //Add faces of the trimesh to the scene.
-          scene->add(tmesh->getFaces().back());
         }
 
         if( generateNormals )
           tmesh->generateNormals();
 
-        //FIXME: Trimeshes must be separated into their component parts before being added to the kdTree (A2 only)
-        //You can do this in a number of different ways, but here is the first possible place to handle that logic
-
-    
         if ((error = tmesh->doubleCheck()))
           throw ParserException(error);
-          
+
+        // The mesh goes into the scene's tree as one object; its faces
+        // are found by the mesh's own tree, built when first needed.
+        if( !instanced )
+          scene->add( tmesh );
+        else
+        {
+          meshes[ name ] = tmesh;
+          scene->add( new TrimeshInstance( scene, tmesh, transform ) );
+        }
+
         return;
       }
 
@@ -699,6 +731,49 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   }
 }
 
+// instance { name = tree; } places the trimesh declared with
+// trimesh { name = tree; instanced; ... } again, under
+// this transform; a material given here replaces the mesh's own.
+void Parser::parseInstance(Scene* scene, TransformNode* transform, const Material& mat)
+{
+  string name;
+  Material* newMat = 0;
+
+  _tokenizer.Read( INSTANCE );
+  _tokenizer.Read( LBRACE );
+
+  for( ;; )
+  {
+    const Token* t = _tokenizer.Peek();
+
+    switch( t->kind() )
+    {
+      case NAME:
+        name = parseIdentExpression();
+        break;
+      case MATERIAL:
+        delete newMat;
+        newMat = parseMaterialExpression( scene, mat );
+        break;
+      case RBRACE:
+      {
+        _tokenizer.Read( RBRACE );
+        auto mesh = meshes.find( name );
+        if( mesh == meshes.end() )
+        {
+          delete newMat;
+          throw ParserException( "Instance of unknown trimesh '" + name + "'" );
+        }
+        scene->add( new TrimeshInstance( scene, mesh->second, transform, newMat ) );
+        return;
+      }
+      default:
+        delete newMat;
+        throw SyntaxErrorException( "Expected: instance attributes", _tokenizer );
+    }
+  }
+}
+
 void Parser::parseFaces( list< glm::dvec3 >& faces )
 {
   list< double > points = parseScalarList();
@@ -87,6 +87,8 @@ string getNameForToken( const SYMBOL kind )
     tokenNames[ INDEX ]             = "index";
     tokenNames[ NAME ]              = "name";
     tokenNames[ MAP ]               = "map";
+    tokenNames[ INSTANCE ]          = "instance";
+    tokenNames[ INSTANCED ]         = "instanced";
   }
   // search tokenNames table
   std::map<int, string>::const_iterator itr = 
@@ -137,6 +139,8 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["gennormals"] = GENNORMALS;
     reservedWords["height"] = HEIGHT;
     reservedWords["index"] = INDEX;
+    reservedWords["instance"] = INSTANCE;
+    reservedWords["instanced"] = INSTANCED;
     reservedWords["linear_attenuation_coeff"] = LINEAR_ATTENUATION_COEFF;
     reservedWords["material"] = MATERIAL;
     reservedWords["materials"] = MATERIALS;
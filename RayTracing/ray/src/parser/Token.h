@@ -70,7 +70,7 @@ enum SYMBOL {
 
   POLYPOINTS, NORMALS,			// keywords affecting polygons
   MATERIALS, FACES,
-  GENNORMALS,
+  GENNORMALS, INSTANCED,
 
   TRANSLATE, SCALE,			// Transforms
   ROTATE, TRANSFORM,
@@ -81,7 +81,8 @@ enum SYMBOL {
   DIFFUSE, TRANSMISSIVE,
   SHININESS, INDEX,
   NAME,
-  MAP
+  MAP,
+  INSTANCE				// another placement of a named trimesh
 };
 
 // Helper functions
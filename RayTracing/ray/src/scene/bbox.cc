@@ -1,5 +1,17 @@
 #include "ray.h"
 #include "bbox.h"
+#include "packet.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 BoundingBox::BoundingBox() : bEmpty(true)
 {
@@ -30,43 +42,169 @@ bool BoundingBox::intersects(const glm::dvec3& point) const
 	        (point[2] - RAY_EPSILON <= bmax[2]));
 }
 
+/*
+ * All the slab tests below are Kay/Kajiya done with the ray's 1/d: the
+ * sign of 1/d says which face of each slab is the near one, so no swaps
+ * and no divisions.  A ray parallel to an axis has an infinite 1/d, which
+ * gives -inf/+inf for that slab when the origin is inside it and puts the
+ * box out of reach when it is not.  The one case that gives a NaN, an
+ * origin exactly on the face it runs along, counts as inside.
+ */
+
+// How much the float test grows a box by, relative to its coordinates.
+static const float FLOAT_PAD = 1.0e-5f;
+
+#if defined(__SSE2__)
+
+namespace {
+
+inline __m128d select(__m128d m, __m128d a, __m128d b)
+{
+	return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b));
+}
+
+// near and far t of the slabs in both lanes
+inline void slabs(__m128d lo, __m128d hi, __m128d o, __m128d inv, __m128d& tn, __m128d& tf)
+{
+	const __m128d inf = _mm_set1_pd(std::numeric_limits<double>::infinity());
+	__m128d neg = _mm_cmplt_pd(inv, _mm_setzero_pd());
+	tn = _mm_mul_pd(_mm_sub_pd(select(neg, hi, lo), o), inv);
+	tf = _mm_mul_pd(_mm_sub_pd(select(neg, lo, hi), o), inv);
+	tn = select(_mm_cmpord_pd(tn, tn), tn, _mm_sub_pd(_mm_setzero_pd(), inf));
+	tf = select(_mm_cmpord_pd(tf, tf), tf, inf);
+}
+
+} // anonymous namespace
+
+// x and y in one register, z alone in the low lane of another.
+bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
+{
+	__m128d tnxy, tfxy, tnz, tfz;
+	slabs(_mm_loadu_pd(&bmin[0]), _mm_loadu_pd(&bmax[0]),
+	      _mm_loadu_pd(&r.p[0]), _mm_loadu_pd(&r.invd[0]), tnxy, tfxy);
+	slabs(_mm_load_sd(&bmin[2]), _mm_load_sd(&bmax[2]),
+	      _mm_load_sd(&r.p[2]), _mm_load_sd(&r.invd[2]), tnz, tfz);
+
+	__m128d tNear = _mm_max_sd(_mm_max_sd(tnxy, tnz), _mm_unpackhi_pd(tnxy, tnxy));
+	__m128d tFar = _mm_min_sd(_mm_min_sd(tfxy, tfz), _mm_unpackhi_pd(tfxy, tfxy));
+	tMin = _mm_cvtsd_f64(tNear);
+	tMax = _mm_cvtsd_f64(tFar);
+	return tMin <= tMax && tMax >= RAY_EPSILON;
+}
+
+// All three axes and the dummy fourth in one register.  The bounds are
+// rounded to float here, and grown by FLOAT_PAD, which covers the rounding
+// of both the box and the ray with plenty to spare.
+bool BoundingBox::intersect(const ray& r, float& tMin, float& tMax) const
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+	const __m128 pad = _mm_set1_ps(FLOAT_PAD);
+	const __m128 abs = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 lo = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(&bmin[0])), _mm_cvtpd_ps(_mm_load_sd(&bmin[2])));
+	__m128 hi = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(&bmax[0])), _mm_cvtpd_ps(_mm_load_sd(&bmax[2])));
+	lo = _mm_sub_ps(lo, _mm_add_ps(pad, _mm_mul_ps(pad, _mm_and_ps(lo, abs))));
+	hi = _mm_add_ps(hi, _mm_add_ps(pad, _mm_mul_ps(pad, _mm_and_ps(hi, abs))));
+	__m128 o = _mm_loadu_ps(r.fp);
+	__m128 inv = _mm_loadu_ps(r.finvd);
+
+	__m128 neg = _mm_cmplt_ps(inv, zero);
+	__m128 nb = _mm_or_ps(_mm_and_ps(neg, hi), _mm_andnot_ps(neg, lo));
+	__m128 fb = _mm_or_ps(_mm_and_ps(neg, lo), _mm_andnot_ps(neg, hi));
+	__m128 tn = _mm_mul_ps(_mm_sub_ps(nb, o), inv);
+	__m128 tf = _mm_mul_ps(_mm_sub_ps(fb, o), inv);
+	__m128 ok = _mm_cmpord_ps(tn, tn);
+	tn = _mm_or_ps(_mm_and_ps(ok, tn), _mm_andnot_ps(ok, _mm_sub_ps(zero, inf)));
+	ok = _mm_cmpord_ps(tf, tf);
+	tf = _mm_or_ps(_mm_and_ps(ok, tf), _mm_andnot_ps(ok, inf));
+
+	tn = _mm_max_ps(tn, _mm_shuffle_ps(tn, tn, _MM_SHUFFLE(1, 0, 3, 2)));
+	tn = _mm_max_ps(tn, _mm_shuffle_ps(tn, tn, _MM_SHUFFLE(2, 3, 0, 1)));
+	tf = _mm_min_ps(tf, _mm_shuffle_ps(tf, tf, _MM_SHUFFLE(1, 0, 3, 2)));
+	tf = _mm_min_ps(tf, _mm_shuffle_ps(tf, tf, _MM_SHUFFLE(2, 3, 0, 1)));
+	tMin = _mm_cvtss_f32(tn);
+	tMax = _mm_cvtss_f32(tf);
+	return tMin <= tMax && tMax >= (float)RAY_EPSILON;
+}
+
+#else
+
+namespace {
+
+// One axis at a time.  A NaN fails both comparisons and is skipped.
+template <typename T>
+bool slabs(const T* lo, const T* hi, const T* o, const T* inv, const int* sign, T& tMin, T& tMax)
+{
+	tMin = -std::numeric_limits<T>::infinity();
+	tMax = std::numeric_limits<T>::infinity();
+	for (int axis = 0; axis < 3; axis++) {
+		const T* nb = sign[axis] ? hi : lo;
+		const T* fb = sign[axis] ? lo : hi;
+		T tn = (nb[axis] - o[axis]) * inv[axis];
+		T tf = (fb[axis] - o[axis]) * inv[axis];
+		if (tn > tMin)
+			tMin = tn;
+		if (tf < tMax)
+			tMax = tf;
+	}
+	return tMin <= tMax && tMax >= (T)RAY_EPSILON;
+}
+
+} // anonymous namespace
+
 bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 {
-	/*
- 	 * Kay/Kajiya algorithm.
-	 */
-	glm::dvec3 R0 = r.getPosition();
-	glm::dvec3 Rd = r.getDirection();
-	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough
-	                 // for us!
-	tMax = 1.0e308;
-	double ttemp;
-
-	for (int currentaxis = 0; currentaxis < 3; currentaxis++) {
-		double vd = Rd[currentaxis];
-		// if the ray is parallel to the face's plane (=0.0)
-		if (vd == 0.0)
+	return slabs(&bmin[0], &bmax[0], &r.p[0], &r.invd[0], r.sign, tMin, tMax);
+}
+
+bool BoundingBox::intersect(const ray& r, float& tMin, float& tMax) const
+{
+	float lo[3], hi[3];
+	for (int axis = 0; axis < 3; axis++) {
+		lo[axis] = (float)bmin[axis];
+		hi[axis] = (float)bmax[axis];
+		lo[axis] -= FLOAT_PAD + FLOAT_PAD * std::fabs(lo[axis]);
+		hi[axis] += FLOAT_PAD + FLOAT_PAD * std::fabs(hi[axis]);
+	}
+	return slabs(lo, hi, r.fp, r.finvd, r.sign, tMin, tMax);
+}
+
+#endif
+
+static_assert(PACKET_SIZE % LANES == 0, "PACKET_SIZE must be a multiple of the SIMD width");
+
+// The double test again, on LANES rays per instruction.  The operations
+// are the same as for a single ray, which makes the results bit for bit
+// the same.
+unsigned BoundingBox::intersect(const RayPacket& p, unsigned mask, double* tMin, double* tMax) const
+{
+	const vdouble zero = vset(0.0);
+	const vdouble inf = vset(std::numeric_limits<double>::infinity());
+	const vdouble ninf = vset(-std::numeric_limits<double>::infinity());
+
+	unsigned hit = 0;
+	for (int k = 0; k < PACKET_SIZE; k += LANES) {
+		if (!((mask >> k) & ((1u << LANES) - 1)))
 			continue;
-		double v1 = bmin[currentaxis] - R0[currentaxis];
-		double v2 = bmax[currentaxis] - R0[currentaxis];
-		// two slab intersections
-		double t1 = v1 / vd;
-		double t2 = v2 / vd;
-		if (t1 > t2) { // swap t1 & t2
-			ttemp = t1;
-			t1    = t2;
-			t2    = ttemp;
+		vdouble tNear = ninf;
+		vdouble tFar = inf;
+		for (int axis = 0; axis < 3; axis++) {
+			vdouble o = vload(&p.o[axis][k]);
+			vdouble inv = vload(&p.invd[axis][k]);
+			vdouble lo = vset(bmin[axis]);
+			vdouble hi = vset(bmax[axis]);
+			vdouble neg = vlt(inv, zero);
+			vdouble tn = vmul(vsub(vselect(neg, hi, lo), o), inv);
+			vdouble tf = vmul(vsub(vselect(neg, lo, hi), o), inv);
+			tNear = vmax(tNear, vselect(vord(tn), tn, ninf));
+			tFar = vmin(tFar, vselect(vord(tf), tf, inf));
 		}
-		if (t1 > tMin)
-			tMin = t1;
-		if (t2 < tMax)
-			tMax = t2;
-		if (tMin > tMax)
-			return false; // box is missed
-		if (tMax < RAY_EPSILON)
-			return false; // box is behind ray
+		vdouble ok = vand(vle(tNear, tFar), vle(vset(RAY_EPSILON), tFar));
+		vstore(tMin + k, tNear);
+		vstore(tMax + k, tFar);
+		hit |= vmask(ok) << k;
 	}
-	return true; // it made it past all 3 axes.
+	return hit & mask;
 }
 
 void BoundingBox::operator=(const BoundingBox& target)
@@ -2,6 +2,7 @@
 
 #include <glm/vec3.hpp>
 class ray;
+class RayPacket;
 
 class BoundingBox {
 	bool bEmpty;
@@ -61,6 +62,15 @@ public:
 	// in tMax and return true, else return false.
 	bool intersect(const ray& r, double& tMin, double& tMax) const;
 
+	// The same test in single precision.  The box is padded a little so
+	// that it never misses where the double test hits; good for culling,
+	// not for exact t values.
+	bool intersect(const ray& r, float& tMin, float& tMax) const;
+
+	// The same test for the lanes of a packet selected by mask.  Returns
+	// the lanes that hit; tMin and tMax are filled in for those.
+	unsigned intersect(const RayPacket& p, unsigned mask, double* tMin, double* tMax) const;
+
 	void operator=(const BoundingBox& target);
 	double area();
 	double volume();
@@ -0,0 +1,445 @@
+#include "bvh.h"
+#include "packet.h"
+#include "scene.h"
+#include "kdTree.h"
+#include "triangles.h"
+#include "../ui/TraceUI.h"
+
+#include <algorithm>
+#include <cfloat>
+
+Bvh::Bvh(const std::vector<Geometry*>& objects, int maxLeafSize)
+	: maxLeafSize(std::max(maxLeafSize, 1))
+{
+	std::vector<BuildItem> items;
+	items.reserve(objects.size());
+	for (Geometry* obj : objects) {
+		if (!obj->hasBoundingBoxCapability()) {
+			unbounded.push_back(obj);
+			continue;
+		}
+		BuildItem item;
+		item.box = obj->getBoundingBox();
+		item.centroid = (item.box.getMin() + item.box.getMax()) * 0.5;
+		item.obj = obj;
+		items.push_back(item);
+	}
+
+	if (items.empty())
+		return;
+	// A binary tree has fewer than two nodes per object.
+	nodes.reserve(2 * items.size());
+	leafObjects.reserve(items.size());
+	build(items, 0, items.size(), 0);
+}
+
+uint32_t Bvh::makeLeaf(std::vector<BuildItem>& items, size_t begin, size_t end, uint32_t index)
+{
+	nodes[index].offset = (uint32_t)leafObjects.size();
+	nodes[index].count = (uint32_t)(end - begin);
+	for (size_t k = begin; k < end; k++)
+		leafObjects.push_back(items[k].obj);
+	return index;
+}
+
+// Binned SAH (Wald, "On fast construction of SAH-based bounding volume
+// hierarchies"): the centroids are dropped into BINS equal slots along the
+// longest axis of their bounds and only the BINS - 1 planes between slots
+// are considered.  Costs are in units of one object intersection, with a
+// node traversal costing the same.
+uint32_t Bvh::build(std::vector<BuildItem>& items, size_t begin, size_t end, int depth)
+{
+	uint32_t index = (uint32_t)nodes.size();
+	nodes.emplace_back();
+	nodes[index].count = 0;
+	nodes[index].axis = 0;
+
+	BoundingBox box, centroids;
+	for (size_t k = begin; k < end; k++) {
+		box.merge(items[k].box);
+		centroids.merge(BoundingBox(items[k].centroid, items[k].centroid));
+	}
+	nodes[index].box = box;
+
+	size_t n = end - begin;
+	if (n == 1 || depth >= MAX_DEPTH - 1)
+		return makeLeaf(items, begin, end, index);
+
+	glm::dvec3 extent = centroids.getMax() - centroids.getMin();
+	int axis = 0;
+	if (extent[1] > extent[axis])
+		axis = 1;
+	if (extent[2] > extent[axis])
+		axis = 2;
+	// All the centroids in one spot: no plane separates them.
+	if (extent[axis] <= 0.0)
+		return makeLeaf(items, begin, end, index);
+
+	double lo = centroids.getMin()[axis];
+	double scale = BINS / extent[axis];
+	auto binOf = [&](const BuildItem& item) {
+		int b = (int)((item.centroid[axis] - lo) * scale);
+		return std::min(b, BINS - 1);
+	};
+
+	BoundingBox binBox[BINS];
+	size_t binCount[BINS] = {};
+	for (size_t k = begin; k < end; k++) {
+		int b = binOf(items[k]);
+		binBox[b].merge(items[k].box);
+		binCount[b]++;
+	}
+
+	// Sweep from the right for the areas and counts of every right side,
+	// then from the left to price each plane.
+	double rightArea[BINS];
+	size_t rightCount[BINS];
+	BoundingBox acc;
+	size_t count = 0;
+	for (int b = BINS - 1; b > 0; b--) {
+		acc.merge(binBox[b]);
+		count += binCount[b];
+		rightArea[b] = acc.area();
+		rightCount[b] = count;
+	}
+
+	int bestPlane = -1;
+	double bestCost = DBL_MAX;
+	acc = BoundingBox();
+	count = 0;
+	for (int b = 0; b < BINS - 1; b++) {
+		acc.merge(binBox[b]);
+		count += binCount[b];
+		if (count == 0 || rightCount[b + 1] == 0)
+			continue;
+		double cost = count * acc.area() + rightCount[b + 1] * rightArea[b + 1];
+		if (cost < bestCost) {
+			bestCost = cost;
+			bestPlane = b;
+		}
+	}
+
+	double area = box.area();
+	double splitCost = 1.0 + (area > 0.0 ? bestCost / area : (double)n);
+	if (bestPlane < 0 || (n <= (size_t)maxLeafSize && n <= splitCost))
+		return makeLeaf(items, begin, end, index);
+
+	auto mid = std::partition(items.begin() + begin, items.begin() + end,
+	                          [&](const BuildItem& item) { return binOf(item) <= bestPlane; });
+	size_t split = mid - items.begin();
+
+	nodes[index].axis = axis;
+	build(items, begin, split, depth + 1);
+	uint32_t right = build(items, split, end, depth + 1);
+	nodes[index].offset = right;
+	return index;
+}
+
+namespace {
+
+// A leaf's triangle is tested just as the kd-tree's blocks test it, on the
+// ray as it is: intersect() would test its box first and, for the faces
+// of an instanced mesh, take the ray through their identity transform,
+// which rounds its direction.  So a mesh's faces give the same hits
+// whichever accelerator it uses.  Anything else is tested as usual.
+bool hitObject(const Geometry* obj, ray& r, isect& i)
+{
+	glm::dvec3 a, b, c;
+	if (!obj->getTriangle(a, b, c))
+		return obj->intersect(r, i);
+	RT_STAT(primitives);
+	double t, u, v;
+	if (!intersectTriangle(r, a, b - a, c - a, DBL_MAX, t, u, v))
+		return false;
+	obj->setTriangleHit(r, t, u, v, i);
+	return true;
+}
+
+bool blocksRay(const Geometry* obj, ray& r, double tmax)
+{
+	glm::dvec3 a, b, c;
+	if (!obj->getTriangle(a, b, c))
+		return obj->occludes(r, tmax);
+	RT_STAT(primitives);
+	double t, u, v;
+	return intersectTriangle(r, a, b - a, c - a, tmax, t, u, v);
+}
+
+} // anonymous namespace
+
+bool Bvh::intersect(ray& r, isect& i) const
+{
+	double best = DBL_MAX;
+	bool found = false;
+	for (Geometry* obj : unbounded) {
+		isect cur;
+		if (obj->intersect(r, cur) && cur.getT() < best) {
+			best = cur.getT();
+			i = cur;
+			found = true;
+		}
+	}
+	if (!nodes.empty() && traverse(r, i, 0, best))
+		found = true;
+	return found;
+}
+
+bool Bvh::occluded(ray& r, double tmax, const Geometry** blocker) const
+{
+	const Geometry* found = nullptr;
+	for (Geometry* obj : unbounded) {
+		if (obj->occludes(r, tmax)) {
+			found = obj;
+			break;
+		}
+	}
+	if (!found && !nodes.empty())
+		found = occludedFrom(r, 0, tmax);
+	if (blocker)
+		*blocker = found;
+	return found != nullptr;
+}
+
+// Depth first, near child first, skipping any node whose box starts
+// beyond the closest hit found so far.
+bool Bvh::traverse(ray& r, isect& i, uint32_t root, double& best) const
+{
+	const int* sign = r.getSign();
+	uint32_t stack[MAX_DEPTH + 1];
+	int top = 0;
+	stack[top++] = root;
+
+	bool found = false;
+	while (top > 0) {
+		uint32_t index = stack[--top];
+		const Node& node = nodes[index];
+		kdNodeCounter.touch(&node);
+
+		double tmin, tmax;
+		RT_STAT(boxes);
+		if (!node.box.intersect(r, tmin, tmax) || tmin > best)
+			continue;
+
+		if (node.count) {
+			for (uint32_t k = 0; k < node.count; k++) {
+				isect cur;
+				if (hitObject(leafObjects[node.offset + k], r, cur) && cur.getT() < best) {
+					best = cur.getT();
+					i = cur;
+					found = true;
+				}
+			}
+			continue;
+		}
+
+		if (sign[node.axis]) {
+			stack[top++] = index + 1;
+			stack[top++] = node.offset;
+		} else {
+			stack[top++] = node.offset;
+			stack[top++] = index + 1;
+		}
+	}
+	return found;
+}
+
+// The same walk for a shadow ray: nodes past limit are skipped and the
+// first object that blocks the ray ends it and is returned.
+const Geometry* Bvh::occludedFrom(ray& r, uint32_t root, double limit) const
+{
+	const int* sign = r.getSign();
+	uint32_t stack[MAX_DEPTH + 1];
+	int top = 0;
+	stack[top++] = root;
+
+	while (top > 0) {
+		uint32_t index = stack[--top];
+		const Node& node = nodes[index];
+		kdNodeCounter.touch(&node);
+
+		double tmin, tmax;
+		RT_STAT(boxes);
+		if (!node.box.intersect(r, tmin, tmax) || tmin > limit)
+			continue;
+
+		if (node.count) {
+			for (uint32_t k = 0; k < node.count; k++)
+				if (blocksRay(leafObjects[node.offset + k], r, limit))
+					return leafObjects[node.offset + k];
+			continue;
+		}
+
+		if (sign[node.axis]) {
+			stack[top++] = index + 1;
+			stack[top++] = node.offset;
+		} else {
+			stack[top++] = node.offset;
+			stack[top++] = index + 1;
+		}
+	}
+	return nullptr;
+}
+
+namespace {
+
+int firstLane(unsigned mask)
+{
+	int k = 0;
+	while (!(mask & (1u << k)))
+		k++;
+	return k;
+}
+
+} // anonymous namespace
+
+// The same walk with one stack for the whole packet.  Each lane keeps its
+// own closest hit, so lanes drop out of a subtree on their own; once only
+// one is left it carries on alone.
+unsigned Bvh::intersect(RayPacket& p, unsigned mask) const
+{
+	double best[PACKET_SIZE];
+	std::fill(best, best + PACKET_SIZE, DBL_MAX);
+
+	unsigned found = 0;
+	for (Geometry* obj : unbounded) {
+		for (int k = 0; k < p.size; k++) {
+			isect cur;
+			if ((mask & (1u << k)) && obj->intersect(*p.rays[k], cur) && cur.getT() < best[k]) {
+				best[k] = cur.getT();
+				*p.hits[k] = cur;
+				found |= 1u << k;
+			}
+		}
+	}
+	if (nodes.empty())
+		return found;
+
+	struct Entry {
+		uint32_t node;
+		unsigned mask;
+	};
+	Entry stack[MAX_DEPTH + 1];
+	int top = 0;
+	stack[top++] = { 0, mask };
+
+	while (top > 0) {
+		Entry e = stack[--top];
+		if ((e.mask & (e.mask - 1)) == 0) {
+			int k = firstLane(e.mask);
+			if (traverse(*p.rays[k], *p.hits[k], e.node, best[k]))
+				found |= 1u << k;
+			continue;
+		}
+
+		const Node& node = nodes[e.node];
+		kdNodeCounter.touch(&node);
+
+		double tmin[PACKET_SIZE], tmax[PACKET_SIZE];
+		RT_STAT(boxes);
+		unsigned live = node.box.intersect(p, e.mask, tmin, tmax);
+		for (int k = 0; k < p.size; k++)
+			if ((live & (1u << k)) && tmin[k] > best[k])
+				live &= ~(1u << k);
+		if (!live)
+			continue;
+
+		if (node.count) {
+			for (uint32_t n = 0; n < node.count; n++) {
+				Geometry* obj = leafObjects[node.offset + n];
+				for (int k = 0; k < p.size; k++) {
+					isect cur;
+					if ((live & (1u << k)) && hitObject(obj, *p.rays[k], cur) && cur.getT() < best[k]) {
+						best[k] = cur.getT();
+						*p.hits[k] = cur;
+						found |= 1u << k;
+					}
+				}
+			}
+			continue;
+		}
+
+		// The rays of a packet mostly agree on direction; go by the first.
+		Entry left = { e.node + 1, live };
+		Entry right = { node.offset, live };
+		if (p.rays[firstLane(live)]->getSign()[node.axis]) {
+			stack[top++] = left;
+			stack[top++] = right;
+		} else {
+			stack[top++] = right;
+			stack[top++] = left;
+		}
+	}
+	return found;
+}
+
+unsigned Bvh::occluded(RayPacket& p, unsigned mask, const double* limit,
+                       const Geometry** blockers) const
+{
+	unsigned blocked = 0;
+	auto block = [&](int k, const Geometry* obj) {
+		blocked |= 1u << k;
+		if (blockers)
+			blockers[k] = obj;
+	};
+
+	for (Geometry* obj : unbounded)
+		for (int k = 0; k < p.size; k++)
+			if ((mask & ~blocked & (1u << k)) && obj->occludes(*p.rays[k], limit[k]))
+				block(k, obj);
+	if (nodes.empty())
+		return blocked;
+
+	struct Entry {
+		uint32_t node;
+		unsigned mask;
+	};
+	Entry stack[MAX_DEPTH + 1];
+	int top = 0;
+	stack[top++] = { 0, mask & ~blocked };
+
+	while (top > 0) {
+		Entry e = stack[--top];
+		e.mask &= ~blocked;
+		if (!e.mask)
+			continue;
+		if ((e.mask & (e.mask - 1)) == 0) {
+			int k = firstLane(e.mask);
+			if (const Geometry* obj = occludedFrom(*p.rays[k], e.node, limit[k]))
+				block(k, obj);
+			continue;
+		}
+
+		const Node& node = nodes[e.node];
+		kdNodeCounter.touch(&node);
+
+		double tmin[PACKET_SIZE], tmax[PACKET_SIZE];
+		RT_STAT(boxes);
+		unsigned live = node.box.intersect(p, e.mask, tmin, tmax);
+		for (int k = 0; k < p.size; k++)
+			if ((live & (1u << k)) && tmin[k] > limit[k])
+				live &= ~(1u << k);
+		if (!live)
+			continue;
+
+		if (node.count) {
+			for (uint32_t n = 0; n < node.count; n++) {
+				Geometry* obj = leafObjects[node.offset + n];
+				for (int k = 0; k < p.size; k++)
+					if ((live & ~blocked & (1u << k)) && blocksRay(obj, *p.rays[k], limit[k]))
+						block(k, obj);
+			}
+			continue;
+		}
+
+		Entry left = { e.node + 1, live };
+		Entry right = { node.offset, live };
+		if (p.rays[firstLane(live)]->getSign()[node.axis]) {
+			stack[top++] = left;
+			stack[top++] = right;
+		} else {
+			stack[top++] = right;
+			stack[top++] = left;
+		}
+	}
+	return blocked;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "bbox.h"
+#include <cstdint>
+#include <vector>
+
+class Geometry;
+class ray;
+class isect;
+class RayPacket;
+
+// A bounding volume hierarchy over the scene's objects, built with binned
+// SAH.  Unlike the kd-tree every object ends up in exactly one leaf, and
+// the build only ever sorts objects into a fixed number of bins, so it is
+// much quicker to build for big meshes.
+//
+// The nodes are kept in one array in depth first order: the left child of
+// a node is the node right after it and the right child is at offset.
+class Bvh {
+public:
+	Bvh(const std::vector<Geometry*>& objects, int maxLeafSize);
+
+	bool intersect(ray& r, isect& i) const;
+
+	// Walks the hierarchy once for all lanes in mask and returns the lanes
+	// that found a hit, each with the same answer intersect() gives.
+	unsigned intersect(RayPacket& p, unsigned mask) const;
+
+	// Any-hit queries for shadow rays: true, or the blocked lanes, as soon
+	// as something is found on the ray before tmax.  The object found goes
+	// in blocker (one per lane for a packet) if given.
+	bool occluded(ray& r, double tmax, const Geometry** blocker = nullptr) const;
+	unsigned occluded(RayPacket& p, unsigned mask, const double* tmax,
+	                  const Geometry** blockers = nullptr) const;
+
+	size_t nodeCount() const { return nodes.size(); }
+
+private:
+	struct Node {
+		BoundingBox box;
+		uint32_t offset; // right child, or first object of a leaf
+		uint32_t count;  // objects in a leaf, 0 for an interior node
+		int axis;        // split axis, says which child is nearer
+	};
+
+	struct BuildItem {
+		BoundingBox box;
+		glm::dvec3 centroid;
+		Geometry* obj;
+	};
+
+	// Deep enough for any sensible tree; the build makes a leaf rather
+	// than go deeper, so traversal can use a fixed size stack.
+	static const int MAX_DEPTH = 64;
+	static const int BINS = 16;
+
+	uint32_t build(std::vector<BuildItem>& items, size_t begin, size_t end, int depth);
+	uint32_t makeLeaf(std::vector<BuildItem>& items, size_t begin, size_t end, uint32_t index);
+	bool traverse(ray& r, isect& i, uint32_t root, double& best) const;
+	const Geometry* occludedFrom(ray& r, uint32_t root, double limit) const;
+
+	std::vector<Node> nodes;
+	std::vector<Geometry*> leafObjects; // the contents of the leaves, in leaf order
+	std::vector<Geometry*> unbounded;   // objects without a bounding box, tested by every ray
+	int maxLeafSize;
+};
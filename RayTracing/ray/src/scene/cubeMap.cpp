@@ -3,73 +3,43 @@
 #include "../ui/TraceUI.h"
 #include "../scene/material.h"
 extern TraceUI* traceUI;
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 using namespace std;
 
+// For each face (+x, -x, +y, -y, +z, -z), the axes of the direction
+// that run along u and v and the signs they are read with.
+static const int uAxis[6] = { 2, 2, 0, 0, 0, 0 };
+static const int vAxis[6] = { 1, 1, 2, 2, 1, 1 };
+static const double uSign[6] = { -1.0, 1.0, 1.0, 1.0, 1.0, -1.0 };
+static const double vSign[6] = { 1.0, 1.0, -1.0, 1.0, 1.0, 1.0 };
+
 glm::dvec3 CubeMap::getColor(ray r) const
 {
-	// YOUR CODE HERE
-	// FIXME: Implement Cube Map here
-	//eturn glm::dvec3(0,0,0);
-
-	glm::dvec3 dVec = (r.getDirection());
-	double x = dVec.x;
-	double y = dVec.y;
-	double z = dVec.z;
-
-	double xAbs = fabs(x);
-	double yAbs = fabs(y);
-	double zAbs = fabs(z);
-	int index = 0;
-	double u;
-	double v;
-	double max;
-
-	if((x > 0) && (zAbs <= xAbs) && (yAbs <= xAbs)){
-		//Right
-		index = 0;
-		u = ((z * -1.0) / xAbs + 1.0) / 2.0;
-		v = (y / xAbs + 1.0) / 2.0;
-	}
-
-	if((x <= 0) && (yAbs <= xAbs) && (zAbs <= xAbs)){
-		//Left
-		index = 1;
-		u = ((z / xAbs) + 1.0) / 2.0;
-		v = ((y / xAbs) + 1.0) / 2.0;
-	}
-
-	if((y > 0) && (xAbs <= yAbs) && (zAbs <= yAbs)){
-		//Top
-		index = 2;
-		u = ((x / yAbs) + 1.0) / 2.0;
-		v = (((-1.0 * z) / yAbs) + 1.0) / 2.0;
-	}
-
-	if((y <= 0) && (zAbs <= yAbs) && (xAbs <= yAbs)){
-		//Bottom
-		index = 3;
-		u = ((x / yAbs) + 1.0) / 2.0;
-		v = ((z / yAbs) + 1.0) / 2.0;
-	}
-
-	if((z > 0) && (xAbs <= zAbs) && (yAbs <= zAbs)){
-		//Front
-		index = 4;
-		u = ((x / zAbs) + 1.0) / 2.0;
-		v = ((y / zAbs) + 1.0) / 2.0;
-	}
-
-	if((z <= 0) && (xAbs <= zAbs) && (yAbs <= zAbs)){
-		//Back
-		index = 5;
-		u = (((-1.0 * x) / zAbs) + 1.0) / 2.0;
-		v = ((y / zAbs) + 1.0) / 2.0;
-	}	
-
-
-	return tMap[index]->getMappedValue(glm::dvec2(u,v));
+	glm::dvec3 d = r.getDirection();
+	glm::dvec3 a = glm::abs(d);
+
+	// The face is picked by the major axis and its sign, with no
+	// branches; ties go to z, then to y.
+	int zMajor = (a.z >= a.x) & (a.z >= a.y);
+	int yMajor = (1 - zMajor) & (a.y >= a.x);
+	int axis = yMajor + 2 * zMajor;
+	int face = 2 * axis + (d[axis] <= 0.0);
+
+	double m = a[axis];
+	double u = (uSign[face] * d[uAxis[face]] / m + 1.0) / 2.0;
+	double v = (vSign[face] * d[vAxis[face]] / m + 1.0) / 2.0;
+
+	// Each face was made into a mip pyramid when it was loaded, so
+	// the filter is a single lookup at the level whose texels are the
+	// filter width wide, or as wide as the pixel if that is more.  The
+	// face is 2 across at distance m, so the ray's spread covers
+	// spread / 2m of it.
+	const TextureMap* map = tMap[face].get();
+	double texel = 1.0 / std::max(map->getWidth(), map->getHeight());
+	double footprint = std::max(traceUI->getFilterWidth() * texel, r.getSpread() / (2.0 * m));
+	return map->getMappedValue(glm::dvec2(u, v), footprint);
 }
 
 CubeMap::CubeMap()
@@ -1,5 +1,11 @@
 #pragma once
 #include "scene.h"
+#include "packet.h"
+#include "triangles.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 
 
 using namespace std;
@@ -9,38 +15,201 @@ class Geometry;
 // Note: you can put kd-tree here
 
 
-class splitPlane {
+// Per-thread count of kd-tree (or BVH) nodes visited during traversal.
+// recent is a small direct-mapped table of the nodes this thread touched
+// last, so cold counts the visits to nodes it has not seen lately; a
+// coherent pixel order keeps that number down.  Like the ray counters
+// (see TraceUI.h) it only exists in an RT_STATS build; otherwise touch()
+// is empty and no thread carries the table.
+class KdNodeCounter {
 public:
+#ifdef RT_STATS
+    unsigned long long touched = 0;
+    unsigned long long cold = 0;
 
-    int axis;
-    double position;
-    bool isLeft = true;
-    int leftCount;
-    int rightCount;
-    bool operator< (const splitPlane &other) const {
-        return position < other.position;
+    void touch(const void* node) {
+        touched++;
+        uintptr_t h = (reinterpret_cast<uintptr_t>(node) >> 3) * 0x9E3779B97F4A7C15ull;
+        const void*& slot = recent[h >> (64 - RECENT_BITS)];
+        if (slot != node) {
+            slot = node;
+            cold++;
+        }
     }
-    BoundingBox leftBox;
-    BoundingBox rightBox;
 
+private:
+    static const int RECENT_BITS = 12;
+    const void* recent[1 << RECENT_BITS] = {};
+#else
+    void touch(const void*) {}
+#endif
 };
 
+extern thread_local KdNodeCounter kdNodeCounter;
 
-class Node {
+// A kd-tree over the scene's objects.  The build follows Wald and Havran,
+// "On building fast kd-trees for ray tracing, and on doing that in
+// O(N log N)": the split candidates (the faces of every object's box) are
+// sorted once per axis, and each split hands its children lists that are
+// still in order, so no node sorts more than the objects it cuts through.
+// Planes are priced with the SAH, and subtrees big enough to be worth it
+// are built on threads of their own.
+//
+// The result is one array of 8 byte nodes in depth first order.  An
+// interior node's below child is the node right after it and its above
+// child is found by index; a leaf's objects are a run of indices in one
+// array shared by all leaves, plain triangles first, and those triangles
+// are also packed into blocks of their own for the SIMD test, in double
+// or, for half the memory and twice the lanes per SSE vector, in float.
+// Without child boxes the traversal cuts each ray's [tmin, tmax] at the
+// split planes instead.
+class KdTree {
 public:
-    bool isRoot = false;
-    int axis;
-    double position;
-    Node* leftChild;
-    Node* rightChild;
-    std::vector<Geometry*> objList;
-    bool isLeaf = false;
-    BoundingBox leftBox;
-    BoundingBox rightBox;
-};
+    // Builds no deeper than depth, and stops splitting at maxLeafSize
+    // objects or once the SAH says a leaf is cheaper.  threads is how many
+    // subtrees may be built at the same time.  With singlePrecision the
+    // leaves' triangles are tested in float; only the closest one is then
+    // worked out again in double.
+    KdTree(const std::vector<Geometry*>& objects, const BoundingBox& bounds, int depth, int maxLeafSize, int threads = 1,
+           bool singlePrecision = false);
+    ~KdTree();
+
+    // Where in the cache directory dir the tree for sceneFile built with
+    // these parameters goes; the name is a hash of the scene file's
+    // contents and the parameters.  Empty if sceneFile can't be read.
+    static std::string cacheFile(const std::string& dir, const char* sceneFile, int depth, int maxLeafSize);
+
+    // Maps a tree written by save() back in for the same objects, or
+    // returns nullptr if file is missing or does not belong to them.
+    static KdTree* load(const std::string& file, const std::vector<Geometry*>& objects, const BoundingBox& bounds,
+                        bool singlePrecision = false);
+    bool save(const std::string& file) const;
+
+    // The cache file next to file for part of the same scene, such as one
+    // mesh's own tree; part is the mesh's place among the scene's objects.
+    static std::string partCacheFile(const std::string& file, size_t part);
+
+    // load()s the tree from cache, or builds it and saves it there if it
+    // is not.  With an empty cache it just builds.
+    static KdTree* cached(const std::string& cache, const std::vector<Geometry*>& objects, const BoundingBox& bounds,
+                          int depth, int maxLeafSize, int threads, bool singlePrecision);
+
+    bool intersect(ray& r, isect& i) const;
+
+    // Walks the tree once for all the rays in the packet and returns the
+    // lanes that found a hit, each with the same answer intersect() gives.
+    // Once only one lane is left in a subtree it carries on alone.
+    unsigned intersect(RayPacket& p) const;
+
+    // True if anything lies on r before tmax.  Stops at the first such
+    // object, which goes in blocker if given, and works out nothing else;
+    // that is all a shadow ray needs.
+    bool occluded(ray& r, double tmax, const Geometry** blocker = nullptr) const;
+
+    // The same for the lanes of a packet, each up to its own tmax.
+    // Returns the lanes that are blocked; blockers, if given, has one
+    // entry per lane.
+    unsigned occluded(RayPacket& p, const double* tmax, const Geometry** blockers = nullptr) const;
+
+    size_t nodeCount() const { return numNodes; }
+
+private:
+    struct CompactNode {
+        union {
+            float split;         // interior: where the plane cuts the axis
+            uint32_t leaf;       // leaf: its entry in leaves
+        };
+        // Low two bits: the split axis, or 3 for a leaf.  The rest: the
+        // above child of an interior node, or the object count of a leaf.
+        uint32_t bits;
 
-Node* buildKdTree(std::vector<Geometry*> objects,BoundingBox bb, int depth, int maxLeafSize);
+        bool isLeaf() const { return (bits & 3) == 3; }
+        int axis() const { return bits & 3; }
+        uint32_t aboveChild() const { return bits >> 2; }
+        uint32_t count() const { return bits >> 2; }
+    };
+    static_assert(sizeof(CompactNode) == 8, "kd-tree nodes should be 8 bytes");
 
-splitPlane findBestPlane(std::vector<Geometry*> objects, BoundingBox bb);
+    // The tree is built no deeper than this, which bounds the traversal
+    // stack: each level pushes at most one far child.
+    static const int MAX_DEPTH = 64;
 
-bool findIntersection(ray &r, isect &i, double tmin, double tmax, Node* node);
+    // Where a leaf's objects are.  The first triangles of its run in
+    // objectIndices are also in the blocks from firstBlock on, and are
+    // only ever tested there.
+    struct Leaf {
+        uint32_t firstIndex;
+        uint32_t count;
+        uint32_t triangles;
+        uint32_t firstBlock;
+    };
+
+    // The closest triangle hit so far.  Only its t goes in the isect; the
+    // rest is worked out once the walk is over, see resolve().
+    struct TriangleHit {
+        uint32_t object = TriangleBlock::NO_OBJECT;
+        double u;
+        double v;
+    };
+
+    struct BuildNode;
+    struct Mapping;
+
+    KdTree(const std::vector<Geometry*>& objects, const BoundingBox& bounds, bool singlePrecision);
+
+    // A far child still to be visited, with the ray's piece of it.
+    struct Todo {
+        uint32_t node;
+        double tmin;
+        double tmax;
+    };
+
+    // The same for the lanes of a packet.
+    struct PacketEntry {
+        uint32_t node;
+        unsigned mask;
+        double tmin[PACKET_SIZE];
+        double tmax[PACKET_SIZE];
+    };
+
+    uint32_t compile(const BuildNode* node);
+    bool valid() const;
+    bool packTriangles();
+    template <typename Real>
+    bool packTriangles(std::vector<TriangleBlockOf<Real>>& out) const;
+    bool enter(const ray& r, double& tmin, double& tmax) const;
+    uint32_t descend(const ray& r, uint32_t index, double tmin, double& tmax, Todo* todo, int& top) const;
+    void descend(const RayPacket& p, const PacketEntry& e, std::vector<PacketEntry>& stack) const;
+    bool traverse(ray& r, isect& i, TriangleHit& tri, double tmin, double tmax, uint32_t root, uint32_t rayId) const;
+    const Geometry* occludedFrom(ray& r, double limit, double tmin, double tmax, uint32_t root, uint32_t rayId) const;
+    bool leafHits(const Leaf& leaf, ray& r, isect& i, TriangleHit& tri, uint32_t rayId) const;
+    const Geometry* leafBlocker(const Leaf& leaf, ray& r, double limit, uint32_t rayId) const;
+    template <typename Real>
+    bool blockHits(const TriangleBlockOf<Real>* block, uint32_t triangles, ray& r, isect& i, TriangleHit& tri) const;
+    template <typename Real>
+    const Geometry* blockBlocker(const TriangleBlockOf<Real>* block, uint32_t triangles, ray& r, double limit) const;
+    void resolve(const ray& r, isect& i, const TriangleHit& tri) const;
+
+    // The tree itself, either in the vectors below or in a mapped cache file.
+    const CompactNode* nodes = nullptr;
+    size_t numNodes = 0;
+    const Leaf* leaves = nullptr;
+    size_t numLeaves = 0;
+    const uint32_t* objectIndices = nullptr;
+    size_t numIndices = 0;
+
+    std::vector<CompactNode> nodeStore;
+    std::vector<Leaf> leafStore;
+    std::vector<uint32_t> indexStore;
+    std::unique_ptr<Mapping> mapping;
+
+    // Rebuilt from the objects even for a tree from a file.  Only one of
+    // the two is filled in.
+    bool singlePrecision;
+    std::vector<TriangleBlock> blocks;
+    std::vector<TriangleBlockOf<float>> floatBlocks;
+
+    std::vector<Geometry*> objects;
+    std::vector<Geometry*> unbounded; // objects without a bounding box, tested by every ray
+    BoundingBox bounds;
+};
@@ -1,3 +1,4 @@
+#include <cfloat>
 #include <cmath>
 #include <iostream>
 
@@ -19,6 +20,58 @@ double DirectionalLight::distanceAttenuation(const glm::dvec3& P) const
 }
 
 
+bool Light::occluded(ray& shadow, double tmax) const
+{
+	if (lastOccluderBlocks(shadow, tmax))
+		return true;
+	const Geometry* obj;
+	if (!scene->occluded(shadow, tmax, &obj))
+		return false;
+	setLastOccluder(obj);
+	return true;
+}
+
+bool Light::lastOccluderBlocks(ray& shadow, double tmax) const
+{
+	OccluderCache& c = occluderCache[ray_thread_id];
+#ifdef RT_STATS
+	c.queries++;
+#endif
+	if (c.last && !TraceUI::m_debug && c.last->occludes(shadow, tmax)) {
+#ifdef RT_STATS
+		c.hits++;
+#endif
+		return true;
+	}
+	return false;
+}
+
+// A query that finds nothing keeps the old object: the next point may well
+// be back in its shadow.
+void Light::setLastOccluder(const Geometry* obj) const
+{
+	if (obj)
+		occluderCache[ray_thread_id].last = obj;
+}
+
+Light::OccluderStats Light::getOccluderStats() const
+{
+	OccluderStats sum = {};
+	for (int t = 0; t < MAX_THREADS; t++) {
+		sum.queries += occluderCache[t].queries;
+		sum.hits += occluderCache[t].hits;
+	}
+	return sum;
+}
+
+Light::OccluderStats Light::resetOccluderStats() const
+{
+	OccluderStats sum = getOccluderStats();
+	for (int t = 0; t < MAX_THREADS; t++)
+		occluderCache[t].queries = occluderCache[t].hits = 0;
+	return sum;
+}
+
 glm::dvec3 DirectionalLight::shadowAttenuation(const ray& r, const glm::dvec3& p) const
 {
 	// YOUR CODE HERE:
@@ -27,10 +80,9 @@ glm::dvec3 DirectionalLight::shadowAttenuation(const ray& r, const glm::dvec3& p
 	//return glm::dvec3(1,1,1);
 	glm::dvec3 direction = getDirection(p);
 	const glm::dvec3& pos = p + (r.getDirection() * -1.0 * (RAY_EPSILON));
-	ray shadow(pos, direction, glm::dvec3(1,1,1), ray::VISIBILITY);
+	ray shadow(pos, direction, glm::dvec3(1,1,1), ray::SHADOW, r.getDepth());
 	
-	isect shadowintersect;
-	if(scene->intersect(shadow, shadowintersect)){
+	if(occluded(shadow, DBL_MAX)){
 		return glm::dvec3(0.0, 0.0, 0.0);
 	}
 
@@ -73,26 +125,25 @@ glm::dvec3 PointLight::getDirection(const glm::dvec3& P) const
 }
 
 
-glm::dvec3 PointLight::shadowAttenuation(const ray& r, const glm::dvec3& p) const
+ray PointLight::shadowRay(const ray& r, const glm::dvec3& p, double& dist) const
 {
-	// YOUR CODE HERE:
-	// You should implement shadow-handling code here.
 	glm::dvec3 direction;
 	direction = glm::normalize(position - p);
 	const glm::dvec3& pos = p + (r.getDirection() * -1.0 * (RAY_EPSILON));
-	ray shadow(pos, direction, glm::dvec3(1,1,1), ray::VISIBILITY);
-	
-	isect shadowintersect;
-	if(scene->intersect(shadow, shadowintersect)){
-		double t = shadowintersect.getT();
+	dist = glm::length(position - p);
+	return ray(pos, direction, glm::dvec3(1,1,1), ray::SHADOW, r.getDepth());
+}
+
+glm::dvec3 PointLight::shadowAttenuation(const ray& r, const glm::dvec3& p) const
+{
+	// YOUR CODE HERE:
+	// You should implement shadow-handling code here.
+	double tprime;
+	ray shadow = shadowRay(r, p, tprime);
 	
-		//if vector from point to intersection < point to light, then we are in shadow
-		double tprime = glm::length(position - p);
-		if(t < tprime) {
-			return glm::dvec3(0.0, 0.0, 0.0);
-		} else {
-			return glm::dvec3(1.0, 1.0, 1.0);
-		}
+	//in shadow if anything is hit between the point and the light
+	if(occluded(shadow, tprime)) {
+		return glm::dvec3(0.0, 0.0, 0.0);
 	}
 	
 	return glm::dvec3(1,1,1);
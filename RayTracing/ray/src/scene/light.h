@@ -20,12 +20,41 @@ public:
 	virtual glm::dvec3 getColor() const = 0;
 	virtual glm::dvec3 getDirection (const glm::dvec3& P) const = 0;
 
+	// Does anything block shadow before tmax?  Neighbouring points are
+	// mostly shadowed by the same object, so each thread remembers the
+	// last object that blocked this light and tries it before asking the
+	// scene.
+	bool occluded(ray& shadow, double tmax) const;
+
+	// The two halves of occluded(), for callers that ask the scene
+	// themselves: try the remembered object, and remember a new one.
+	bool lastOccluderBlocks(ray& shadow, double tmax) const;
+	void setLastOccluder(const Geometry* obj) const;
+
+	// How often the remembered object answered the query, summed over
+	// the threads.  Like the ray counters, only call these between renders,
+	// and only counted in an RT_STATS build.
+	struct OccluderStats {
+		unsigned long long queries;
+		unsigned long long hits;
+	};
+	OccluderStats getOccluderStats() const;
+	OccluderStats resetOccluderStats() const;
 
 protected:
 	Light(Scene *scene, const glm::dvec3& col) : SceneElement(scene), color(col) {}
 
 	glm::dvec3 color;
 
+	// One per thread, indexed by ray_thread_id, each on its own cache
+	// line so that threads never share one.
+	struct alignas(64) OccluderCache {
+		const Geometry* last = nullptr;
+		unsigned long long queries = 0;
+		unsigned long long hits = 0;
+	};
+	mutable OccluderCache occluderCache[MAX_THREADS];
+
 public:
 	virtual void glDraw(GLenum lightID) const { }
 	virtual void glDraw() const { }
@@ -68,6 +97,10 @@ public:
 	virtual glm::dvec3 getColor() const;
 	virtual glm::dvec3 getDirection(const glm::dvec3& P) const;
 
+	// The shadow ray from pos, where r hit a surface, towards the light;
+	// anything it hits closer than dist blocks the light.
+	ray shadowRay(const ray& r, const glm::dvec3& pos, double& dist) const;
+
 	void setAttenuationConstants(float a, float b, float c)
 	{
 		constantTerm = a;
@@ -6,6 +6,8 @@
 extern TraceUI* traceUI;
 
 #include <glm/gtx/io.hpp>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include "../fileio/images.h"
 
@@ -18,19 +20,22 @@ Material::~Material()
 
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
-glm::dvec3 Material::shade(Scene* scene, const ray& r, const isect& i) const
+glm::dvec3 Material::shade(Scene* scene, const ray& r, const isect& i,
+                           const glm::dvec3* shadows) const
 {
 
 	glm::dvec3 color = ke(i) + ka(i)*(scene->ambient());
 	vector<Light*>::iterator light;
 	double t = i.getT();
 	glm::dvec3 Q = r.at(t);
+	int lightIndex = 0;
 	for ( const auto& pLight : scene->getAllLights() )
 	{
 		Light* curLight = pLight.get();
 		glm::dvec3 incidentVec = curLight->getDirection(Q);
 
-		glm::dvec3 atten = curLight->distanceAttenuation(Q) * curLight->shadowAttenuation(r, Q);
+		glm::dvec3 shadow = shadows ? shadows[lightIndex++] : curLight->shadowAttenuation(r, Q);
+		glm::dvec3 atten = curLight->distanceAttenuation(Q) * shadow;
 
 		double diff = glm::dot(incidentVec, i.getN());
 		if(diff < 0){
@@ -85,9 +90,15 @@ glm::dvec3 Material::shade(Scene* scene, const ray& r, const isect& i) const
 	
 }
 
+TextureMap::Level::Level(int w, int h)
+	: width(w), height(h), tilesX((w + TILE - 1) / TILE)
+{
+	texels.resize((size_t)tilesX * ((h + TILE - 1) / TILE) * TILE * TILE);
+}
+
 TextureMap::TextureMap(string filename)
 {
-	data = readImage(filename.c_str(), width, height);
+	std::vector<uint8_t> data = readImage(filename.c_str(), width, height);
 	if (data.empty()) {
 		width = 0;
 		height = 0;
@@ -96,74 +107,98 @@ TextureMap::TextureMap(string filename)
 		error.append("'.");
 		throw TextureMapException(error);
 	}
-}
 
-glm::dvec3 TextureMap::getMappedValue(const glm::dvec2& coord) const
-{
-	// YOUR CODE HERE
-	//
-	// In order to add texture mapping support to the
-	// raytracer, you need to implement this function.
-	// What this function should do is convert from
-	// parametric space which is the unit square
-	// [0, 1] x [0, 1] in 2-space to bitmap coordinates,
-	// and use these to perform bilinear interpolation
-	// of the values.
-
-	//cout << coord[0];
-	double coordX = coord.x;
-	double coordY = coord.y;
-	if(coordX > 1){
-		coordX = 1.0;
+	Level full(width, height);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			const uint8_t* p = &data[((size_t)y * width + x) * 3];
+			// 257 takes 255 to 65535.
+			full.texels[full.index(x, y)] = {{ (uint16_t)(p[0] * 257), (uint16_t)(p[1] * 257),
+			                                   (uint16_t)(p[2] * 257), 65535 }};
+		}
 	}
-	if(coordY > 1){
-		coordY = 1.0;
+	levels.push_back(std::move(full));
+
+	// Each level is the average of 2 x 2 texels of the one before,
+	// rounded to nearest; the last row or column of an odd sized level
+	// is left out.
+	while (levels.back().width > 1 || levels.back().height > 1) {
+		const Level& fine = levels.back();
+		Level coarse(std::max(fine.width / 2, 1), std::max(fine.height / 2, 1));
+		for (int y = 0; y < coarse.height; y++) {
+			int y0 = std::min(2 * y, fine.height - 1);
+			int y1 = std::min(2 * y + 1, fine.height - 1);
+			for (int x = 0; x < coarse.width; x++) {
+				int x0 = std::min(2 * x, fine.width - 1);
+				int x1 = std::min(2 * x + 1, fine.width - 1);
+				const Level::Texel& a = fine.texels[fine.index(x0, y0)];
+				const Level::Texel& b = fine.texels[fine.index(x1, y0)];
+				const Level::Texel& c = fine.texels[fine.index(x0, y1)];
+				const Level::Texel& d = fine.texels[fine.index(x1, y1)];
+				Level::Texel& t = coarse.texels[coarse.index(x, y)];
+				for (int k = 0; k < 4; k++)
+					t[k] = (uint16_t)((a[k] + b[k] + c[k] + d[k] + 2) / 4);
+			}
+		}
+		levels.push_back(std::move(coarse));
 	}
+}
 
+// The level whose texels are as wide as the footprint, in between two
+// levels if need be: log2 of how many full size texels it covers.
+glm::dvec3 TextureMap::getMappedValue(const glm::dvec2& coord, double footprint) const
+{
+	double texels = footprint * std::max(width, height);
+	if (!(texels > 1.0))
+		return levels[0].bilinear(coord);
+	double lod = std::log2(texels);
+	int last = (int)levels.size() - 1;
+	if (lod >= last)
+		return levels[last].bilinear(coord);
+	int level = (int)lod;
+	return glm::mix(levels[level].bilinear(coord), levels[level + 1].bilinear(coord), lod - level);
+}
 
-	double x = coordX * width;
-	double y = coordY * height;
-
-	int x1 = floor(x);
-	int x2 = x + 1;
-	int y1 = floor(y);
-	int y2 = y + 1;
-
-	//Get Q Points
-	glm::dvec3 Q12 = getPixelAt(x1, y2);
-	glm::dvec3 Q11 = getPixelAt(x1, y1);
-	glm::dvec3 Q21 = getPixelAt(x2, y1);
-	glm::dvec3 Q22 = getPixelAt(x2, y2);
-
-	//Get R Points
-	glm::dvec3 R1 = (Q11 * ((x2 - x) / (x2 - x1)) )  +  (Q21 * ((x - x1) / (x2 - x1)));
-	glm::dvec3 R2 = (Q12 * ((x2 - x) / (x2 - x1)) )  +  (Q22 * ((x - x1) / (x2 - x1)));  
-
-	glm::dvec3 P = R1 * ((y2 - y) / (y2 - y1)) + R2 * ((y - y1) / (y2 - y1));
+static glm::vec3 toFloat(const std::array<uint16_t, 4>& t)
+{
+	return glm::vec3(t[0], t[1], t[2]);
+}
 
-	return P;
+// Texel (x, y) covers [x, x + 1] x [y, y + 1] of the level scaled up to
+// its size, so its value is exact at the center; past the edges the
+// border texels go on.  The blend is done in float, on 0..65535, and
+// scaled to 0..1 at the end.
+glm::dvec3 TextureMap::Level::bilinear(const glm::dvec2& coord) const
+{
+	double x = glm::clamp(coord.x, 0.0, 1.0) * width - 0.5;
+	double y = glm::clamp(coord.y, 0.0, 1.0) * height - 0.5;
+	double fx = std::floor(x);
+	double fy = std::floor(y);
+	int x0 = std::max((int)fx, 0);
+	int y0 = std::max((int)fy, 0);
+	int x1 = std::min((int)fx + 1, width - 1);
+	int y1 = std::min((int)fy + 1, height - 1);
+	float wx = (float)(x - fx);
+	float wy = (float)(y - fy);
+
+	glm::vec3 a = toFloat(texels[index(x0, y0)]);
+	glm::vec3 b = toFloat(texels[index(x1, y0)]);
+	glm::vec3 c = toFloat(texels[index(x0, y1)]);
+	glm::vec3 d = toFloat(texels[index(x1, y1)]);
+	glm::vec3 top = a + (b - a) * wx;
+	glm::vec3 bottom = c + (d - c) * wx;
+	return glm::dvec3(top + (bottom - top) * wy) / 65535.0;
 }
 
 glm::dvec3 TextureMap::getPixelAt(int x, int y) const
 {
-	// YOUR CODE HERE
-	//
-	// In order to add texture mapping support to the
-	// raytracer, you need to implement this function.
-
-
-	int start = (y * width + x) * 3;
-	double r = data[start] / 255.0;
-	double g = data[start + 1] / 255.0;
-	double b = data[start + 2] / 255.0;
-
-	return glm::dvec3(r, g, b);
+	return glm::dvec3(toFloat(levels[0].texels[levels[0].index(x, y)])) / 65535.0;
 }
 
 glm::dvec3 MaterialParameter::value(const isect& is) const
 {
 	if (0 != _textureMap)
-		return _textureMap->getMappedValue(is.getUVCoordinates());
+		return _textureMap->getMappedValue(is.getUVCoordinates(), is.getUVFootprint());
 	else
 		return _value;
 }
@@ -172,7 +207,7 @@ double MaterialParameter::intensityValue(const isect& is) const
 {
 	if (0 != _textureMap) {
 		glm::dvec3 value(
-		        _textureMap->getMappedValue(is.getUVCoordinates()));
+		        _textureMap->getMappedValue(is.getUVCoordinates(), is.getUVFootprint()));
 		return (0.299 * value[0]) + (0.587 * value[1]) +
 		       (0.114 * value[2]);
 	} else
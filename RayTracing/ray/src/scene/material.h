@@ -10,6 +10,7 @@
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 #include <glm/glm.hpp>
+#include <array>
 #include <string>
 #include <vector>
 #include <stdint.h>
@@ -22,9 +23,9 @@ using std::string;
 
 /* The TextureMap class can be used to store a texture map,
    which consists of a bitmap and various accessors to
-   it.  To implement basic texture mapping, you'll want to 
-   fill in the getMappedValue function to implement basic 
-   texture mapping.
+   it.  When the bitmap is loaded a pyramid of smaller and
+   smaller copies of it (a mipmap) is made for lookups
+   that cover more than one texel.
 */
 class TextureMap {
     public:
@@ -34,22 +35,52 @@ class TextureMap {
        // is assumed to be within the parametrization space:
        // [0, 1] x [0, 1]
        // (i.e., {(u, v): 0 <= u <= 1 and 0 <= v <= 1}
-       glm::dvec3 getMappedValue( const glm::dvec2& coord ) const;
+       // footprint is how wide, in the same units, the area
+       // the value stands for is; the two levels of the
+       // pyramid whose texels are nearest that size are
+       // interpolated (trilinear filtering).  0 reads the
+       // full size image.
+       glm::dvec3 getMappedValue( const glm::dvec2& coord, double footprint = 0.0 ) const;
 
        // Retrieve the value stored in a physical location
-       // (with integer coordinates) in the bitmap.
-       // Should be called from getMappedValue in order to
-       // do bilinear interpolation.
+       // (with integer coordinates) in the full size bitmap.
        glm::dvec3 getPixelAt( int x, int y ) const;
 
 	   int getWidth() const { return width; }
 	   int getHeight() const { return height; }
+	   int getLevels() const { return (int)levels.size(); }
 
 	  ~TextureMap() { }
 protected:
+       // One level of the pyramid.  The texels are kept in
+       // TILE x TILE squares, one after the other, so that the
+       // four texels of a bilinear lookup are nearly always in
+       // the same few cache lines.  A texel is 16 bit RGBA,
+       // 0 to 65535 for 0 to 1, and only becomes float when it
+       // is read; the alpha is unused.  That holds an 8 bit
+       // image exactly and gives the averages of the coarser
+       // levels 8 more bits, in half the memory of float.
+       struct Level {
+              static const int TILE = 4;
+              typedef std::array<uint16_t, 4> Texel;
+
+              int width;
+              int height;
+              int tilesX;
+              std::vector<Texel> texels;
+
+              Level( int w, int h );
+              size_t index( int x, int y ) const
+              {
+                     return ((y / TILE) * tilesX + x / TILE) * TILE * TILE +
+                            (y % TILE) * TILE + x % TILE;
+              }
+              glm::dvec3 bilinear( const glm::dvec2& coord ) const;
+       };
+
        int width;
        int height;
-       std::vector<uint8_t> data;
+       std::vector<Level> levels; // full size first, down to 1 x 1
 };
 
 class TextureMapException {
@@ -179,7 +210,10 @@ public:
         : _ke( e ), _ka( a ), _ks( s ), _kd( d ), _kr( r ), _kt( t ), 
           _shininess( glm::dvec3(sh,sh,sh) ), _index( glm::dvec3(in,in,in) ) { setBools(); }
 
-    virtual glm::dvec3 shade( Scene *scene, const ray& r, const isect& i ) const;
+    // shadows, if given, holds the shadow attenuation of every light in
+    // the order of Scene::getAllLights(), already traced by the caller.
+    virtual glm::dvec3 shade( Scene *scene, const ray& r, const isect& i,
+                              const glm::dvec3* shadows = nullptr ) const;
 
 
     
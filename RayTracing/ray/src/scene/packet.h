@@ -0,0 +1,53 @@
+//
+// packet.h
+//
+// Packets of coherent rays that are traced through the kd-tree together.
+//
+
+#ifndef __PACKET_H__
+#define __PACKET_H__
+
+#include "ray.h"
+
+// Rays per packet.  4 fills one AVX register of doubles; 8 is worth a try
+// on wider machines.
+#ifndef PACKET_SIZE
+#define PACKET_SIZE 4
+#endif
+
+// Pixels covered by one camera packet: PACKET_W x PACKET_H.
+#define PACKET_W 2
+#define PACKET_H (PACKET_SIZE / PACKET_W)
+
+// A packet only points at its rays and at the isects that receive the
+// hits; origins and inverse directions are copied into lanes so that the
+// box tests can run on all of them at once.
+class RayPacket {
+public:
+	RayPacket() : size(0) {}
+
+	void add(ray* r, isect* i)
+	{
+		glm::dvec3 p = r->getPosition();
+		glm::dvec3 inv = r->getInvDirection();
+		for (int axis = 0; axis < 3; axis++) {
+			o[axis][size] = p[axis];
+			invd[axis][size] = inv[axis];
+		}
+		rays[size] = r;
+		hits[size] = i;
+		size++;
+	}
+
+	// one bit per lane in use
+	unsigned lanes() const { return (1u << size) - 1; }
+
+	int size;
+	ray* rays[PACKET_SIZE];
+	isect* hits[PACKET_SIZE];
+
+	alignas(32) double o[3][PACKET_SIZE] = {};
+	alignas(32) double invd[3][PACKET_SIZE] = {};
+};
+
+#endif // __PACKET_H__
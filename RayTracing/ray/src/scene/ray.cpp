@@ -1,4 +1,6 @@
 #include "ray.h"
+#include <algorithm>
+#include <limits>
 #include "../ui/TraceUI.h"
 #include "material.h"
 #include "scene.h"
@@ -12,15 +14,19 @@ const Material& isect::getMaterial() const
 ray::ray(const glm::dvec3& pp,
 	 const glm::dvec3& dd,
 	 const glm::dvec3& w,
-         RayType tt)
-        : p(pp), d(dd), atten(w), t(tt)
+         RayType tt,
+	 int level)
+        : p(pp), d(dd), atten(w), t(tt), depth(level)
 {
-	TraceUI::addRay(ray_thread_id);
+	updateInverse();
+	updateFloat();
+	TraceUI::addRay(ray_thread_id, t, depth);
 }
 
-ray::ray(const ray& other) : p(other.p), d(other.d), atten(other.atten)
+// A copy is not another ray through the scene, so it is not counted.
+ray::ray(const ray& other)
 {
-	TraceUI::addRay(ray_thread_id);
+	*this = other;
 }
 
 ray::~ray()
@@ -31,11 +37,38 @@ ray& ray::operator=(const ray& other)
 {
 	p     = other.p;
 	d     = other.d;
+	invd  = other.invd;
 	atten = other.atten;
+	footWidth  = other.footWidth;
+	footSpread = other.footSpread;
+	std::copy(other.sign, other.sign + 3, sign);
+	std::copy(other.fp, other.fp + 4, fp);
+	std::copy(other.finvd, other.finvd + 4, finvd);
 	t     = other.t;
+	depth = other.depth;
 	return *this;
 }
 
+// A zero component gives an infinite inverse of the same sign, which the
+// slab tests rely on.  The fourth float lane is a dummy axis the ray runs
+// parallel to, inside the dummy slab around 0 the float box test adds.
+void ray::updateInverse()
+{
+	for (int axis = 0; axis < 3; axis++) {
+		invd[axis] = 1.0 / d[axis];
+		sign[axis] = invd[axis] < 0;
+		finvd[axis] = (float)invd[axis];
+	}
+	finvd[3] = std::numeric_limits<float>::infinity();
+}
+
+void ray::updateFloat()
+{
+	for (int axis = 0; axis < 3; axis++)
+		fp[axis] = (float)p[axis];
+	fp[3] = 0.0f;
+}
+
 glm::dvec3 ray::at(const isect& i) const
 {
 	return at(i.getT());
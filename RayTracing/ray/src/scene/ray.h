@@ -30,8 +30,10 @@ class ray {
 public:
 	enum RayType { VISIBILITY, REFLECTION, REFRACTION, SHADOW };
 
+	// depth is the recursion depth, 0 for rays from the camera; only
+	// used to keep statistics.
 	ray(const glm::dvec3& pp, const glm::dvec3& dd, const glm::dvec3& w,
-	    RayType tt = VISIBILITY);
+	    RayType tt = VISIBILITY, int depth = 0);
 	ray(const ray& other);
 	~ray();
 
@@ -44,15 +46,55 @@ public:
 	glm::dvec3 getDirection() const { return d; }
 	glm::dvec3 getAtten() const { return atten; }
 	RayType type() const { return t; }
+	int getDepth() const { return depth; }
+
+	// 1/d, and for each axis 1 if the ray runs toward -infinity on it.
+	// Kept in step with the direction for the slab tests in BoundingBox.
+	glm::dvec3 getInvDirection() const { return invd; }
+	const int* getSign() const { return sign; }
+
+	// How wide the bundle of light the ray stands for is at its start,
+	// and how fast that width grows along it: a camera ray starts as a
+	// point and spreads by a pixel's angle.  Textures use the width at a
+	// hit to pick their level of detail; 0 asks for full resolution.
+	void setFootprint(double width, double spread)
+	{
+		footWidth = width;
+		footSpread = spread;
+	}
+	double footprintAt(double t) const { return footWidth + footSpread * t; }
+	double getSpread() const { return footSpread; }
 
-	void setPosition(const glm::dvec3& pp) { p = pp; }
-	void setDirection(const glm::dvec3& dd) { d = dd; }
+	void setPosition(const glm::dvec3& pp)
+	{
+		p = pp;
+		updateFloat();
+	}
+	void setDirection(const glm::dvec3& dd)
+	{
+		d = dd;
+		updateInverse();
+	}
 
 private:
+	friend class BoundingBox;
+
+	void updateInverse();
+	void updateFloat();
+
 	glm::dvec3 p;
 	glm::dvec3 d;
+	glm::dvec3 invd;
+	int sign[3];
+	// p and 1/d rounded to float, padded to four lanes, for the single
+	// precision slab test
+	float fp[4];
+	float finvd[4];
 	glm::dvec3 atten;
+	double footWidth = 0.0;
+	double footSpread = 0.0;
 	RayType t;
+	int depth;
 };
 
 
@@ -60,7 +102,7 @@ private:
 
 class isect {
 public:
-	isect() : obj(NULL), t(0.0), N(), material(nullptr) {}
+	isect() : obj(NULL), part(NULL), t(0.0), N(), material(nullptr) {}
 	isect(const isect& other)
 	{
 		copyFromOther(other);
@@ -75,6 +117,11 @@ public:
 	}
 
 	void setObject(const SceneObject* o) { obj = o; }
+	const SceneObject* getObject() const { return obj; }
+	// For an object made of others, such as an instance of a mesh, the
+	// one the ray hit, left for the object's resolveHit() to finish.
+	void setPart(const SceneObject* p) { part = p; }
+	const SceneObject* getPart() const { return part; }
 
 	// Get/Set Time of flight
 	void setT(double tt) { t = tt; }
@@ -100,7 +147,16 @@ public:
 	{
 		setBary(glm::dvec3(alpha, beta, gamma));
 	}
+	glm::dvec3 getBary() const { return bary; }
+	// The object gives how far the uv coordinates move per unit of
+	// distance at the hit, and Scene::intersect() the ray's footprint
+	// there; their product is how much of the texture the hit covers.
+	void setUVScale(double s) { uvScale = s; }
+	double getUVScale() const { return uvScale; }
+	void setFootprint(double width) { footprint = width; }
+	double getUVFootprint() const { return uvScale * footprint; }
 	const Material& getMaterial() const;
+	void clearMaterial() { material.reset(); }
 
 private:
 	void copyFromOther(const isect& other)
@@ -108,10 +164,13 @@ private:
 		if (this == &other)
 			return ;
 		obj           = other.obj;
+		part          = other.part;
 		t             = other.t;
 		N             = other.N;
 		bary          = other.bary;
 		uvCoordinates = other.uvCoordinates;
+		uvScale       = other.uvScale;
+		footprint     = other.footprint;
 		if (other.material) {
 			setMaterial(*other.material);
 		} else {
@@ -120,14 +179,19 @@ private:
 	}
 
 	const SceneObject* obj;
+	const SceneObject* part;
 	double t;
 	glm::dvec3 N;
 	glm::dvec2 uvCoordinates;
 	glm::dvec3 bary;
+	double uvScale = 0.0;
+	double footprint = 0.0;
 
 	// if this intersection has its own material
 	// (as opposed to one in its associated object)
-	// as in the case where the material was interpolated
+	// as in the case where the material was interpolated.
+	// Only Geometry::resolveHit() sets one, so the copies made while
+	// looking for the closest hit never allocate.
 	std::unique_ptr<Material> material;
 };
 
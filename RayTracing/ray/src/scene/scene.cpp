@@ -1,8 +1,11 @@
+#include <algorithm>
 #include <cmath>
 
 #include "scene.h"
 #include "light.h"
 #include "kdTree.h"
+#include "bvh.h"
+#include "packet.h"
 #include "../ui/TraceUI.h"
 #include <glm/gtx/extended_min_max.hpp>
 #include <iostream>
@@ -12,15 +15,21 @@ using namespace std;
 
 bool Geometry::intersect(ray& r, isect& i) const {
 	double tmin, tmax;
-	if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax))) return false;
+	RT_STAT(primitives);
+	if (hasBoundingBoxCapability()) {
+		RT_STAT(boxes);
+		if (!bounds.intersect(r, tmin, tmax)) return false;
+	}
+	if (worldSpace)
+		return intersectLocal(r, i);
 	// Transform the ray into the object's local coordinate space
 	glm::dvec3 pos = transform->globalToLocalCoords(r.getPosition());
 	glm::dvec3 dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
 	double length = glm::length(dir);
 	dir = glm::normalize(dir);
-	// Backup World pos/dir, and switch to local pos/dir
-	glm::dvec3 Wpos = r.getPosition();
-	glm::dvec3 Wdir = r.getDirection();
+	// Backup the world ray, and switch to local pos/dir; restoring the
+	// copy saves working out 1/d again.
+	const ray world(r);
 	r.setPosition(pos);
 	r.setDirection(dir);
 	bool rtrn = false;
@@ -29,14 +38,40 @@ bool Geometry::intersect(ray& r, isect& i) const {
 		// Transform the intersection point & normal returned back into global space.
 		i.setN(transform->localToGlobalCoordsNormal(i.getN()));
 		i.setT(i.getT()/length);
+		i.setUVScale(i.getUVScale()*length);
 		rtrn = true;
 	}
 	// Restore World pos/dir
-	r.setPosition(Wpos);
-	r.setDirection(Wdir);
+	r = world;
+	return rtrn;
+}
+
+bool Geometry::occludes(ray& r, double tmax) const {
+	double tmin, tboxmax;
+	RT_STAT(primitives);
+	if (hasBoundingBoxCapability()) {
+		RT_STAT(boxes);
+		if (!bounds.intersect(r, tmin, tboxmax)) return false;
+	}
+	if (worldSpace)
+		return occludesLocal(r, tmax);
+	glm::dvec3 pos = transform->globalToLocalCoords(r.getPosition());
+	glm::dvec3 dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
+	double length = glm::length(dir);
+	dir = glm::normalize(dir);
+	const ray world(r);
+	r.setPosition(pos);
+	r.setDirection(dir);
+	bool rtrn = occludesLocal(r, tmax * length);
+	r = world;
 	return rtrn;
 }
 
+bool Geometry::occludesLocal(ray& r, double tmax) const {
+	isect i;
+	return intersectLocal(r, i) && i.getT() < tmax;
+}
+
 bool Geometry::hasBoundingBoxCapability() const {
 	// by default, primitives do not have to specify a bounding box.
 	// If this method returns true for a primitive, then either the ComputeBoundingBox() or
@@ -99,6 +134,7 @@ Scene::~Scene()
 }
 
 void Scene::add(Geometry* obj) {
+	obj->bakeTransform();
 	obj->ComputeBoundingBox();
 	sceneBounds.merge(obj->getBoundingBox());
 	objects.emplace_back(obj);
@@ -110,31 +146,39 @@ void Scene::add(Light* light)
 }
 
 
+void Scene::setKd(KdTree* k)
+{
+	kdtree.reset(k);
+}
+
+void Scene::setBvh(Bvh* b)
+{
+	bvh.reset(b);
+}
+
+// How wide the ray's footprint is where it lands on the surface: a ray
+// that only grazes it smears its width along it.
+static void setFootprint(const ray& r, isect& i)
+{
+	double cosine = std::abs(glm::dot(i.getN(), r.getDirection()));
+	i.setFootprint(r.footprintAt(i.getT()) / std::max(cosine, 0.05));
+}
+
 // Get any intersection with an object.  Return information about the 
 // intersection through the reference parameter.
 bool Scene::intersect(ray& r, isect& i) const {
-	double tmin = 0.0;
-	double tmax = 0.0;
-
-	//cout << "in scene intersect";
-
 	bool have_one = false;
-	if(sceneBounds.intersect(r, tmin, tmax)){
-		//cout << "calling findINtersection";
-		
-		have_one = (findIntersection(r, i, tmin, tmax, kdRoot));
-	} 
-	
-	// for(const auto& obj : objects) {
-	// 	isect cur;
-	// 	if( obj->intersect(r, cur) ) {
-	// 		if(!have_one || (cur.getT() < i.getT())) {
-	// 			i = cur;
-	// 			have_one = true;
-	// 		}
-	// 	}
-	// }
-	if(!have_one)
+	if (bvh) {
+		have_one = bvh->intersect(r, i);
+	} else if (kdtree) {
+		have_one = kdtree->intersect(r, i);
+	} else {
+		have_one = intersectAll(r, i);
+	}
+	if (have_one) {
+		i.getObject()->resolveHit(r, i);
+		setFootprint(r, i);
+	} else
 		i.setT(1000.0);
 	// if debugging,
 	if (TraceUI::m_debug)
@@ -144,6 +188,79 @@ bool Scene::intersect(ray& r, isect& i) const {
 	return have_one;
 }
 
+bool Scene::intersectAll(ray& r, isect& i) const {
+	bool have_one = false;
+	for(const auto& obj : objects) {
+		isect cur;
+		if( obj->intersect(r, cur) ) {
+			if(!have_one || (cur.getT() < i.getT())) {
+				i = cur;
+				have_one = true;
+			}
+		}
+	}
+	return have_one;
+}
+
+unsigned Scene::intersect(RayPacket& p) const {
+	unsigned have = 0;
+	if (bvh) {
+		have = bvh->intersect(p, p.lanes());
+	} else if (kdtree) {
+		have = kdtree->intersect(p);
+	} else {
+		for (int k = 0; k < p.size; k++)
+			if (intersectAll(*p.rays[k], *p.hits[k]))
+				have |= 1u << k;
+	}
+	for (int k = 0; k < p.size; k++) {
+		if (have & (1u << k)) {
+			p.hits[k]->getObject()->resolveHit(*p.rays[k], *p.hits[k]);
+			setFootprint(*p.rays[k], *p.hits[k]);
+		} else
+			p.hits[k]->setT(1000.0);
+	}
+	return have;
+}
+
+bool Scene::occluded(ray& r, double tmax, const Geometry** blocker) const {
+	// The debugger draws every ray with its intersection, so give it one.
+	// It does not say which object that is, so there is no blocker.
+	if (TraceUI::m_debug) {
+		if (blocker)
+			*blocker = nullptr;
+		isect i;
+		return intersect(r, i) && i.getT() < tmax;
+	}
+	if (bvh)
+		return bvh->occluded(r, tmax, blocker);
+	if (kdtree)
+		return kdtree->occluded(r, tmax, blocker);
+	for (const auto& obj : objects) {
+		if (obj->occludes(r, tmax)) {
+			if (blocker)
+				*blocker = obj;
+			return true;
+		}
+	}
+	if (blocker)
+		*blocker = nullptr;
+	return false;
+}
+
+unsigned Scene::occluded(RayPacket& p, const double* tmax,
+                         const Geometry** blockers) const {
+	if (bvh && !TraceUI::m_debug)
+		return bvh->occluded(p, p.lanes(), tmax, blockers);
+	if (kdtree && !TraceUI::m_debug)
+		return kdtree->occluded(p, tmax, blockers);
+	unsigned blocked = 0;
+	for (int k = 0; k < p.size; k++)
+		if (occluded(*p.rays[k], tmax[k], blockers ? &blockers[k] : nullptr))
+			blocked |= 1u << k;
+	return blocked;
+}
+
 TextureMap* Scene::getTexture(string name) {
 	auto itr = textureCache.find(name);
 	if (itr == textureCache.end()) {
@@ -10,6 +10,7 @@
 #define __SCENE_H__
 
 #include <algorithm>
+#include <cmath>
 #include <map>
 #include <memory>
 #include <string>
@@ -33,10 +34,9 @@ using std::unique_ptr;
 
 class Light;
 class Scene;
-class Node;
-
-template <typename Obj>
 class KdTree;
+class Bvh;
+class RayPacket;
 
 class SceneElement {
 public:
@@ -114,6 +114,31 @@ public:
 
 	const glm::dmat4x4& transform() const { return xform; }
 
+	// The scale of a transform that only rotates, scales evenly and
+	// translates, so that spheres stay spheres; 0 for any other.
+	double uniformScale() const
+	{
+		glm::dmat3x3 m(xform);
+		glm::dmat3x3 mtm = glm::transpose(m) * m;
+		double s2 = mtm[0][0];
+		for (int c = 0; c < 3; c++)
+			for (int r = 0; r < 3; r++)
+				if (std::abs(mtm[c][r] - (c == r ? s2 : 0.0)) > 1e-12 * s2)
+					return 0.0;
+		return std::sqrt(s2);
+	}
+
+	// Does the transform only scale along the axes, by positive amounts,
+	// and translate?  Boxes stay axis aligned under those.
+	bool axisAligned() const
+	{
+		for (int c = 0; c < 3; c++)
+			for (int r = 0; r < 3; r++)
+				if (c == r ? xform[c][r] <= 0.0 : xform[c][r] != 0.0)
+					return false;
+		return true;
+	}
+
 protected:
 	// protected so that users can't directly construct one of these...
 	// force them to use the createChild() method.  Note that they CAN
@@ -142,13 +167,53 @@ public:
 class Geometry : public SceneElement {
 protected:
 	// intersections performed in the object's local coordinate space
+	// (or in world space, see bakeTransform())
 	// do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal(ray& r, isect& i) const = 0;
 
+	// the local half of occludes(), with tmax in local units.  By default
+	// this is intersectLocal() with the intersection thrown away; objects
+	// can do without working out normals and materials.
+	virtual bool occludesLocal(ray& r, double tmax) const;
+
 public:
 	// intersections performed in the global coordinate space.
 	bool intersect(ray& r, isect& i) const;
 
+	// Does r hit this object before tmax?  The same test as intersect(),
+	// for shadow rays that only need a yes or no.
+	bool occludes(ray& r, double tmax) const;
+
+	// An object that is one plain triangle can give its corners, in the
+	// space intersect() takes rays in, and leave the accelerators to test
+	// it in batches (see triangles.h).  Anything else returns false.
+	virtual bool getTriangle(glm::dvec3& a, glm::dvec3& b, glm::dvec3& c) const { return false; }
+
+	// Fills in i for such a triangle hit by r at t, where u and v are the
+	// barycentric weights of b and c, as intersect() would have.
+	virtual void setTriangleHit(const ray& r, double t, double u, double v, isect& i) const {}
+
+	// intersect() need only give what it takes to pick the closest hit:
+	// t, the object and whatever the object wants back here.  Once a
+	// search is over, the hit it settled on is finished with this, which
+	// works out anything intersect() left for it (the normal, the UVs, an
+	// interpolated material).  By default there is nothing left to do.
+	virtual void resolveHit(const ray& r, isect& i) const {}
+
+	// Called once as the object joins the scene, when its transform is
+	// final.  An object that can do without the transform works out its
+	// shape in world space here and sets worldSpace; from then on
+	// intersect() and occludes() hand intersectLocal() and occludesLocal()
+	// the world ray as it is.  By default nothing is baked.
+	virtual void bakeTransform() {}
+
+	// An object made of many parts, like a trimesh, can keep them in an
+	// accelerator of its own.  RayTracer::loadScene() has every object
+	// build it here, with the scene's settings, before any ray is traced;
+	// a kd-tree may be kept in the cache file named cache, if that is not
+	// empty.  By default there is nothing to build.
+	virtual void buildAccel(const std::string& cache) {}
+
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
 	glm::dvec3 getNormal() { return glm::dvec3(1.0, 0.0, 0.0); }
@@ -182,6 +247,7 @@ public:
 protected:
 	BoundingBox bounds;
 	TransformNode* transform;
+	bool worldSpace = false; // see bakeTransform()
 };
 
 // A SceneObject is a real actual thing that we want to model in the
@@ -234,6 +300,17 @@ public:
 	void add(Light* light);
 
 	bool intersect(ray& r, isect& i) const;
+	// Intersect all the rays of a packet; returns the lanes that hit.
+	unsigned intersect(RayPacket& p) const;
+
+	// Is anything in the way of r before tmax?  Cheaper than intersect()
+	// for shadow rays: it stops at the first blocker, which goes in blocker
+	// if given, and works out no shading information.
+	bool occluded(ray& r, double tmax, const Geometry** blocker = nullptr) const;
+	// The same for a packet, each lane up to its own tmax; returns the
+	// lanes that are blocked and, if blockers is given, what blocked them.
+	unsigned occluded(RayPacket& p, const double* tmax,
+	                  const Geometry** blockers = nullptr) const;
 
 	auto beginLights() const { return lights.begin(); }
 	auto endLights() const { return lights.end(); }
@@ -241,9 +318,8 @@ public:
 
 	std::vector<Geometry*> getObjects() const { return objects; }
 
-	void setKd(Node* rootNode){
-		kdRoot = rootNode;
-	}
+	void setKd(KdTree* k);
+	void setBvh(Bvh* b);
 
 	auto beginObjects() const { return objects.cbegin(); }
 	auto endObjects() const { return objects.cend(); }
@@ -292,8 +368,12 @@ private:
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
 
-	KdTree<Geometry>* kdtree;
-	Node* kdRoot;
+	std::unique_ptr<KdTree> kdtree;
+	// With neither a kd-tree nor a BVH, every ray is tested against every
+	// object.
+	std::unique_ptr<Bvh> bvh;
+
+	bool intersectAll(ray& r, isect& i) const;
 
 	mutable std::mutex intersectionCacheMutex;
 
@@ -0,0 +1,118 @@
+#pragma once
+
+// Just enough of a SIMD vector of doubles for the packet slab test and
+// the triangle kernel: LANES doubles per vector, AVX if the compiler is
+// allowed it, else SSE2, else one plain double.  Comparisons give a mask
+// that vand/vor/vselect/vmask take.  vfloat is the same for floats, four
+// to an SSE vector (a triangle block is only four wide), for the kernel's
+// single precision blocks.
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX__)
+typedef __m256d vdouble;
+const int LANES = 4;
+inline vdouble vset(double a) { return _mm256_set1_pd(a); }
+inline vdouble vload(const double* p) { return _mm256_loadu_pd(p); }
+inline void vstore(double* p, vdouble a) { _mm256_storeu_pd(p, a); }
+inline vdouble vadd(vdouble a, vdouble b) { return _mm256_add_pd(a, b); }
+inline vdouble vsub(vdouble a, vdouble b) { return _mm256_sub_pd(a, b); }
+inline vdouble vmul(vdouble a, vdouble b) { return _mm256_mul_pd(a, b); }
+inline vdouble vdiv(vdouble a, vdouble b) { return _mm256_div_pd(a, b); }
+inline vdouble vmin(vdouble a, vdouble b) { return _mm256_min_pd(a, b); }
+inline vdouble vmax(vdouble a, vdouble b) { return _mm256_max_pd(a, b); }
+inline vdouble vle(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+inline vdouble vlt(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+inline vdouble vne(vdouble a, vdouble b) { return _mm256_cmp_pd(a, b, _CMP_NEQ_UQ); }
+inline vdouble vord(vdouble a) { return _mm256_cmp_pd(a, a, _CMP_ORD_Q); }
+inline vdouble vand(vdouble a, vdouble b) { return _mm256_and_pd(a, b); }
+inline vdouble vselect(vdouble m, vdouble a, vdouble b) { return _mm256_blendv_pd(b, a, m); }
+inline unsigned vmask(vdouble m) { return (unsigned)_mm256_movemask_pd(m); }
+#elif defined(__SSE2__)
+typedef __m128d vdouble;
+const int LANES = 2;
+inline vdouble vset(double a) { return _mm_set1_pd(a); }
+inline vdouble vload(const double* p) { return _mm_loadu_pd(p); }
+inline void vstore(double* p, vdouble a) { _mm_storeu_pd(p, a); }
+inline vdouble vadd(vdouble a, vdouble b) { return _mm_add_pd(a, b); }
+inline vdouble vsub(vdouble a, vdouble b) { return _mm_sub_pd(a, b); }
+inline vdouble vmul(vdouble a, vdouble b) { return _mm_mul_pd(a, b); }
+inline vdouble vdiv(vdouble a, vdouble b) { return _mm_div_pd(a, b); }
+inline vdouble vmin(vdouble a, vdouble b) { return _mm_min_pd(a, b); }
+inline vdouble vmax(vdouble a, vdouble b) { return _mm_max_pd(a, b); }
+inline vdouble vle(vdouble a, vdouble b) { return _mm_cmple_pd(a, b); }
+inline vdouble vlt(vdouble a, vdouble b) { return _mm_cmplt_pd(a, b); }
+inline vdouble vne(vdouble a, vdouble b) { return _mm_cmpneq_pd(a, b); }
+inline vdouble vord(vdouble a) { return _mm_cmpord_pd(a, a); }
+inline vdouble vand(vdouble a, vdouble b) { return _mm_and_pd(a, b); }
+inline vdouble vselect(vdouble m, vdouble a, vdouble b) { return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b)); }
+inline unsigned vmask(vdouble m) { return (unsigned)_mm_movemask_pd(m); }
+#else
+// No SIMD: one lane at a time, with comparisons giving 0 or 1.
+typedef double vdouble;
+const int LANES = 1;
+inline vdouble vset(double a) { return a; }
+inline vdouble vload(const double* p) { return *p; }
+inline void vstore(double* p, vdouble a) { *p = a; }
+inline vdouble vadd(vdouble a, vdouble b) { return a + b; }
+inline vdouble vsub(vdouble a, vdouble b) { return a - b; }
+inline vdouble vmul(vdouble a, vdouble b) { return a * b; }
+inline vdouble vdiv(vdouble a, vdouble b) { return a / b; }
+inline vdouble vmin(vdouble a, vdouble b) { return a < b ? a : b; }
+inline vdouble vmax(vdouble a, vdouble b) { return a > b ? a : b; }
+inline vdouble vle(vdouble a, vdouble b) { return a <= b ? 1.0 : 0.0; }
+inline vdouble vlt(vdouble a, vdouble b) { return a < b ? 1.0 : 0.0; }
+inline vdouble vne(vdouble a, vdouble b) { return a != b ? 1.0 : 0.0; }
+inline vdouble vord(vdouble a) { return a == a ? 1.0 : 0.0; }
+inline vdouble vand(vdouble a, vdouble b) { return a * b; }
+inline vdouble vselect(vdouble m, vdouble a, vdouble b) { return m != 0.0 ? a : b; }
+inline unsigned vmask(vdouble m) { return m != 0.0 ? 1u : 0u; }
+#endif
+
+#if defined(__SSE2__) || defined(__AVX__)
+typedef __m128 vfloat;
+const int FLOAT_LANES = 4;
+inline vfloat vset(float a) { return _mm_set1_ps(a); }
+inline vfloat vload(const float* p) { return _mm_loadu_ps(p); }
+inline void vstore(float* p, vfloat a) { _mm_storeu_ps(p, a); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+inline vfloat vdiv(vfloat a, vfloat b) { return _mm_div_ps(a, b); }
+inline vfloat vle(vfloat a, vfloat b) { return _mm_cmple_ps(a, b); }
+inline vfloat vlt(vfloat a, vfloat b) { return _mm_cmplt_ps(a, b); }
+inline vfloat vne(vfloat a, vfloat b) { return _mm_cmpneq_ps(a, b); }
+inline vfloat vand(vfloat a, vfloat b) { return _mm_and_ps(a, b); }
+inline unsigned vmask(vfloat m) { return (unsigned)_mm_movemask_ps(m); }
+#else
+typedef float vfloat;
+const int FLOAT_LANES = 1;
+inline vfloat vset(float a) { return a; }
+inline vfloat vload(const float* p) { return *p; }
+inline void vstore(float* p, vfloat a) { *p = a; }
+inline vfloat vadd(vfloat a, vfloat b) { return a + b; }
+inline vfloat vsub(vfloat a, vfloat b) { return a - b; }
+inline vfloat vmul(vfloat a, vfloat b) { return a * b; }
+inline vfloat vdiv(vfloat a, vfloat b) { return a / b; }
+inline vfloat vle(vfloat a, vfloat b) { return a <= b ? 1.0f : 0.0f; }
+inline vfloat vlt(vfloat a, vfloat b) { return a < b ? 1.0f : 0.0f; }
+inline vfloat vne(vfloat a, vfloat b) { return a != b ? 1.0f : 0.0f; }
+inline vfloat vand(vfloat a, vfloat b) { return a * b; }
+inline unsigned vmask(vfloat m) { return m != 0.0f ? 1u : 0u; }
+#endif
+
+// The vector and its width for a scalar type, for code written once for
+// both.
+template <typename Real> struct Simd;
+template <> struct Simd<double> {
+	typedef vdouble type;
+	static const int lanes = LANES;
+};
+template <> struct Simd<float> {
+	typedef vfloat type;
+	static const int lanes = FLOAT_LANES;
+};
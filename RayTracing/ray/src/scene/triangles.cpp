@@ -0,0 +1,154 @@
+#include "triangles.h"
+#include "ray.h"
+#include "simd.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <limits>
+
+static_assert(TRI_LANES % LANES == 0, "TRI_LANES must be a multiple of the SIMD width");
+static_assert(TRI_LANES % FLOAT_LANES == 0, "TRI_LANES must be a multiple of the float SIMD width");
+
+template <typename Real>
+void TriangleBlockOf<Real>::clear()
+{
+	for (int axis = 0; axis < 3; axis++) {
+		for (int k = 0; k < TRI_LANES; k++) {
+			v0[axis][k] = 0;
+			e1[axis][k] = 0;
+			e2[axis][k] = 0;
+		}
+	}
+	for (int k = 0; k < TRI_LANES; k++)
+		object[k] = NO_OBJECT;
+}
+
+// The edges are taken in double and rounded once.
+template <typename Real>
+void TriangleBlockOf<Real>::set(int lane, uint32_t obj, const glm::dvec3& a, const glm::dvec3& b, const glm::dvec3& c)
+{
+	for (int axis = 0; axis < 3; axis++) {
+		v0[axis][lane] = (Real)a[axis];
+		e1[axis][lane] = (Real)(b[axis] - a[axis]);
+		e2[axis][lane] = (Real)(c[axis] - a[axis]);
+	}
+	object[lane] = obj;
+}
+
+bool intersectTriangle(const ray& r, const glm::dvec3& v0, const glm::dvec3& e1, const glm::dvec3& e2,
+                       double tmax, double& t, double& u, double& v)
+{
+	glm::dvec3 o = r.getPosition();
+	glm::dvec3 d = r.getDirection();
+
+	// p = d x e2; det is zero for a ray in the triangle's plane.
+	double px = d[1] * e2[2] - d[2] * e2[1];
+	double py = d[2] * e2[0] - d[0] * e2[2];
+	double pz = d[0] * e2[1] - d[1] * e2[0];
+	double det = e1[0] * px + e1[1] * py + e1[2] * pz;
+	if (det == 0.0)
+		return false;
+	double inv = 1.0 / det;
+
+	double sx = o[0] - v0[0];
+	double sy = o[1] - v0[1];
+	double sz = o[2] - v0[2];
+	u = (sx * px + sy * py + sz * pz) * inv;
+	if (!(u >= 0.0 && u <= 1.0))
+		return false;
+
+	// q = s x e1
+	double qx = sy * e1[2] - sz * e1[1];
+	double qy = sz * e1[0] - sx * e1[2];
+	double qz = sx * e1[1] - sy * e1[0];
+	v = (d[0] * qx + d[1] * qy + d[2] * qz) * inv;
+	if (!(v >= 0.0 && u + v <= 1.0))
+		return false;
+
+	t = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * inv;
+	return t >= RAY_EPSILON && t < tmax;
+}
+
+// Where a block's hits may start.  A double block takes hits from
+// RAY_EPSILON, as intersectTriangle() and the other objects do; a float
+// one skips the first few float steps of the ray's own coordinates, which
+// is how far rounding can move a shadow or reflection ray's start across
+// the surface it leaves.
+template <typename Real>
+static Real nearestT(const glm::dvec3& o);
+
+template <>
+double nearestT<double>(const glm::dvec3& o)
+{
+	return RAY_EPSILON;
+}
+
+template <>
+float nearestT<float>(const glm::dvec3& o)
+{
+	double size = std::max(std::max(std::abs(o[0]), std::abs(o[1])), std::abs(o[2]));
+	return (float)(32.0 * FLT_EPSILON * (1.0 + size));
+}
+
+template <typename Real>
+unsigned intersectTriangles(const TriangleBlockOf<Real>& b, const ray& r, double tmax, double* t, double* u, double* v)
+{
+	typedef typename Simd<Real>::type vreal;
+	const int lanes = Simd<Real>::lanes;
+
+	glm::dvec3 o = r.getPosition();
+	glm::dvec3 d = r.getDirection();
+	const vreal ox = vset((Real)o[0]), oy = vset((Real)o[1]), oz = vset((Real)o[2]);
+	const vreal dx = vset((Real)d[0]), dy = vset((Real)d[1]), dz = vset((Real)d[2]);
+	const vreal zero = vset((Real)0), one = vset((Real)1);
+	const vreal nearest = vset(nearestT<Real>(o));
+	const vreal limit = vset((Real)std::min(tmax, (double)std::numeric_limits<Real>::max()));
+
+	unsigned hit = 0;
+	Real ts[TRI_LANES], us[TRI_LANES], vs[TRI_LANES];
+	for (int k = 0; k < TRI_LANES; k += lanes) {
+		vreal e1x = vload(&b.e1[0][k]), e1y = vload(&b.e1[1][k]), e1z = vload(&b.e1[2][k]);
+		vreal e2x = vload(&b.e2[0][k]), e2y = vload(&b.e2[1][k]), e2z = vload(&b.e2[2][k]);
+
+		vreal px = vsub(vmul(dy, e2z), vmul(dz, e2y));
+		vreal py = vsub(vmul(dz, e2x), vmul(dx, e2z));
+		vreal pz = vsub(vmul(dx, e2y), vmul(dy, e2x));
+		vreal det = vadd(vadd(vmul(e1x, px), vmul(e1y, py)), vmul(e1z, pz));
+		vreal inv = vdiv(one, det);
+
+		vreal sx = vsub(ox, vload(&b.v0[0][k]));
+		vreal sy = vsub(oy, vload(&b.v0[1][k]));
+		vreal sz = vsub(oz, vload(&b.v0[2][k]));
+		vreal vu = vmul(vadd(vadd(vmul(sx, px), vmul(sy, py)), vmul(sz, pz)), inv);
+
+		vreal qx = vsub(vmul(sy, e1z), vmul(sz, e1y));
+		vreal qy = vsub(vmul(sz, e1x), vmul(sx, e1z));
+		vreal qz = vsub(vmul(sx, e1y), vmul(sy, e1x));
+		vreal vv = vmul(vadd(vadd(vmul(dx, qx), vmul(dy, qy)), vmul(dz, qz)), inv);
+		vreal vt = vmul(vadd(vadd(vmul(e2x, qx), vmul(e2y, qy)), vmul(e2z, qz)), inv);
+
+		vreal ok = vand(vne(det, zero), vand(vle(zero, vu), vle(vu, one)));
+		ok = vand(ok, vand(vle(zero, vv), vle(vadd(vu, vv), one)));
+		ok = vand(ok, vand(vle(nearest, vt), vlt(vt, limit)));
+		unsigned m = vmask(ok);
+		if (m) {
+			vstore(ts + k, vt);
+			vstore(us + k, vu);
+			vstore(vs + k, vv);
+			hit |= m << k;
+		}
+	}
+	for (unsigned m = hit, k = 0; m; m >>= 1, k++) {
+		if (m & 1) {
+			t[k] = ts[k];
+			u[k] = us[k];
+			v[k] = vs[k];
+		}
+	}
+	return hit;
+}
+
+template struct TriangleBlockOf<double>;
+template struct TriangleBlockOf<float>;
+template unsigned intersectTriangles(const TriangleBlockOf<double>&, const ray&, double, double*, double*, double*);
+template unsigned intersectTriangles(const TriangleBlockOf<float>&, const ray&, double, double*, double*, double*);
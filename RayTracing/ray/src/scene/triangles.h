@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <glm/vec3.hpp>
+
+class ray;
+
+// Triangles are tested TRI_LANES at a time out of blocks kept as structure
+// of arrays: one corner and the two edges from it, which is all the
+// Möller-Trumbore test needs, so a leaf full of triangles takes no per
+// triangle setup and no virtual calls.  The blocks come in double and in
+// float; a float block is half the size and fits in one SSE vector.
+#define TRI_LANES 4
+
+template <typename Real>
+struct TriangleBlockOf {
+	static const uint32_t NO_OBJECT = 0xffffffff;
+
+	Real v0[3][TRI_LANES];
+	Real e1[3][TRI_LANES];
+	Real e2[3][TRI_LANES];
+	uint32_t object[TRI_LANES]; // what each lane is, NO_OBJECT if unused
+
+	// Empties every lane; the zero edges of an empty lane never hit.
+	void clear();
+	void set(int lane, uint32_t obj, const glm::dvec3& a, const glm::dvec3& b, const glm::dvec3& c);
+};
+
+typedef TriangleBlockOf<double> TriangleBlock;
+
+// Does r hit the triangle with corner v0 and edges e1 and e2 at a t in
+// [RAY_EPSILON, tmax)?  Either side counts.  If so, t is filled in along with the
+// barycentric weights u of v0 + e1 and v of v0 + e2.
+bool intersectTriangle(const ray& r, const glm::dvec3& v0, const glm::dvec3& e1, const glm::dvec3& e2,
+                       double tmax, double& t, double& u, double& v);
+
+// The same test on every lane of b; returns the lanes that hit, with their
+// t, u and v.  For double blocks the operations are the same as
+// intersectTriangle()'s, so a lane gives bit for bit the same answer.  A
+// float block only counts hits a little way along the ray, past what its
+// rounding could put on the far side of a surface r starts on.
+template <typename Real>
+unsigned intersectTriangles(const TriangleBlockOf<Real>& b, const ray& r, double tmax, double* t, double* u, double* v);
@@ -1,6 +1,8 @@
 #include <stdarg.h>
 #include <time.h>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
 #ifndef _MSC_VER
 #include <unistd.h>
 #else
@@ -15,6 +17,7 @@ extern int getopt(int argc, char** argv, const char* optstring);
 #include "CommandLineUI.h"
 
 #include "../RayTracer.h"
+#include "../scene/light.h"
 
 using namespace std;
 
@@ -78,12 +81,14 @@ int CommandLineUI::run()
 
 		raytracer->traceSetup(width, height);
 
-		clock_t start, end;
-		start = clock();
+		// wall clock time; with several threads the CPU time says little
+		auto start = std::chrono::steady_clock::now();
 
 		raytracer->traceImage(width, height);
+		if (aaSwitch())
+			raytracer->aaImage();
 
-		end = clock();
+		double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
 		// save image
 		unsigned char* buf;
@@ -93,10 +98,9 @@ int CommandLineUI::run()
 		if (buf)
 			writeImage(imgName, width, height, buf);
 
-		double t = (double)(end - start) / CLOCKS_PER_SEC;
-		//		int totalRays = TraceUI::resetCount();
-		//		std::cout << "total time = " << t << " seconds,
-		// rays traced = " << totalRays << std::endl;
+		if (statsSwitch())
+			printStats(t);
+
 		return 0;
 	} else {
 		std::cerr << "Unable to load ray file '" << rayName << "'"
@@ -105,6 +109,47 @@ int CommandLineUI::run()
 	}
 }
 
+void CommandLineUI::printStats(double seconds)
+{
+#ifdef RT_STATS
+	static const char* typeNames[RAY_TYPES] = {
+		"visibility", "reflection", "refraction", "shadow"
+	};
+
+	RayCounter rays = TraceUI::resetRayStats();
+	std::cout << "time: " << seconds << " s, rays: " << rays.total()
+	          << " (" << rays.total() / seconds << " rays/s)" << std::endl;
+	for (int i = 0; i < RAY_TYPES; i++)
+		std::cout << "  " << typeNames[i] << ": " << rays.byType[i]
+		          << " (" << rays.byType[i] / seconds << " rays/s)" << std::endl;
+	for (int i = 0; i < MAX_RAY_DEPTH; i++)
+		if (rays.byDepth[i])
+			std::cout << "  depth " << i << (i == MAX_RAY_DEPTH - 1 ? "+" : "")
+			          << ": " << rays.byDepth[i] << std::endl;
+	std::cout << "  boxes tested: " << rays.boxes
+	          << ", primitives tested: " << rays.primitives << std::endl;
+
+	const auto& lights = raytracer->getScene().getAllLights();
+	for (size_t l = 0; l < lights.size(); l++) {
+		Light::OccluderStats os = lights[l]->resetOccluderStats();
+		if (os.queries)
+			std::cout << "  light " << l << " shadow queries: " << os.queries
+			          << ", answered by last occluder: " << os.hits << " ("
+			          << 100.0 * os.hits / os.queries << "%)" << std::endl;
+	}
+
+	RayTracer::TileStats ts = raytracer->getTileStats();
+	double tiles = (double)std::max(ts.tiles, 1ull);
+	std::cout << "tiles: " << ts.tiles
+	          << ", accel nodes/tile: " << ts.kdNodes / tiles
+	          << ", cold accel nodes/tile: " << ts.kdColdNodes / tiles
+	          << std::endl;
+#else
+	std::cout << "time: " << seconds << " s (build with RT_STATS for counters)"
+	          << std::endl;
+#endif
+}
+
 void CommandLineUI::alert(const string& msg)
 {
 	std::cerr << msg << std::endl;
@@ -19,6 +19,7 @@ public:
 
 private:
 	void		usage();
+	void		printStats( double seconds );
 
 	char*	rayName;
 	char*	imgName;
@@ -237,20 +237,18 @@ void GraphicalUI::cb_aaCheckButton(Fl_Widget* o, void* v)
 	}
 }
 
-void GraphicalUI::cb_kdCheckButton(Fl_Widget* o, void* v)
+void GraphicalUI::cb_accelChoice(Fl_Widget* o, void* v)
 {
 	pUI = (GraphicalUI*)(o->user_data());
-	pUI->m_kdTree = (((Fl_Check_Button*)o)->value() == 1);
-	if (pUI->m_kdTree) 
-	{
+	pUI->m_accel = (Accel)((Fl_Choice*)o)->value();
+	if (pUI->m_accel == KD_TREE)
 		pUI->m_treeDepthSlider->activate();
-		pUI->m_leafSizeSlider->activate();
-	}
 	else
-	{
 		pUI->m_treeDepthSlider->deactivate();
+	if (pUI->m_accel != BRUTE_FORCE)
+		pUI->m_leafSizeSlider->activate();
+	else
 		pUI->m_leafSizeSlider->deactivate();
-	}
 }
 
 void GraphicalUI::cb_cubeMapCheckButton(Fl_Widget* o, void* v)
@@ -265,93 +263,104 @@ void GraphicalUI::cb_cubeMapCheckButton(Fl_Widget* o, void* v)
 	}
 }
 
-void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
+void GraphicalUI::cb_orderChoice(Fl_Widget* o, void* v)
+{
+	pUI = (GraphicalUI*)(o->user_data());
+	pUI->m_pixelOrder = (PixelOrder)((Fl_Choice*)o)->value();
+}
 
-	char buffer[256];
+void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 
 	pUI = (GraphicalUI*)(o->user_data());
 	stopTrace = false;
 	if (pUI->raytracer->sceneLoaded())
 	{
+		// forget about the progress of a render we are about to replace
+		Fl::remove_timeout(cb_refresh, pUI);
+
 		int width = pUI->getSize();
 		int	height = (int)(width / pUI->raytracer->aspectRatio() + 0.5);
-		int origPixels = width * height;
 		pUI->m_traceGlWindow->resizeWindow(width, height);
 		pUI->m_traceGlWindow->show();
-		clock_t startTime, now, prev, traceTime;
-		startTime = now = prev = clock();
-		auto t_start = std::chrono::high_resolution_clock::now();
-		auto t_now = t_start;
-		auto t_elapsed = std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
+		pUI->renderedPixels = 0;
+		pUI->renderPixels = width * height;
+		pUI->antialiasing = false;
+		pUI->renderStart = std::chrono::high_resolution_clock::now();
+
+		// The tracer runs on its own threads; cb_refresh picks up the
+		// finished tiles from the FLTK loop every refreshInterval.
 		pUI->raytracer->traceImage(width, height);
-		clock_t intervalMS = pUI->refreshInterval * 100;
-		traceTime = clock() - startTime;
-		t_now = std::chrono::high_resolution_clock::now();
-		auto t_trace = std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
-		int imageRays = TraceUI::resetCount();
-		print(buffer, "Time: %.2f sec, Rays: %u, Aa: none", t_trace, imageRays);
-		pUI->m_traceGlWindow->label(buffer);
 		pUI->m_traceGlWindow->refresh();
-		if (pUI->aaSwitch() && !stopTrace)
-		{
-			clock_t aaStart, aaTime;
-			auto t_aaStart = std::chrono::high_resolution_clock::now();
-			auto t_total = std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
-			aaStart = now = prev = clock();
-			aaTime = clock() - aaStart;
-			t_now = std::chrono::high_resolution_clock::now();
-			t_elapsed = std::chrono::duration<double, std::ratio<1>>(t_now - t_aaStart).count();
-			t_total = std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
-			int aaRays = TraceUI::resetCount();
-			print(buffer, "Trace: %.2f, Aa: %.2f, Total: %.2f, Rays: %u, %u, %u",
-			      t_trace, t_elapsed, t_total, imageRays, aaRays, imageRays + aaRays);
-			pUI->m_traceGlWindow->label(buffer);
-			pUI->m_traceGlWindow->refresh();
-		}
-/*
-		pUI->raytracer->setThreshold(pUI->getThreshold());
-
-		bool zOrder = false;
-		if (zOrder) {
-			int th = height;
-			int tw = width;
-			while (th != 0) {
-				bits++;
-				th = th >> 1;
-			}      
-			while (tw != 0) {
-				bits++;
-				tw = tw >> 1;
-			}      
+		Fl::add_timeout(pUI->refreshInterval * 0.1, cb_refresh, pUI);
+	}
+}
+
+void GraphicalUI::cb_refresh(void* v)
+{
+	char buffer[256];
+
+	pUI = (GraphicalUI*)v;
+
+	// Ask before draining: once the workers are idle every tile they
+	// finished is already in the queue.
+	bool done = !pUI->raytracer->checkRender();
+
+	Tile tile;
+	while (pUI->raytracer->nextFinishedTile(tile)) {
+		pUI->m_traceGlWindow->refreshTile(tile);
+		pUI->renderedPixels += tile.w * tile.h;
+	}
+
+	if (!done) {
+		int frac = std::min(100, (int)(100.0 * pUI->renderedPixels / std::max(pUI->renderPixels, 1)));
+		print(buffer, "%d%% of %s", frac, traceWindowLabel);
+		pUI->m_traceGlWindow->copy_label(buffer);
+		Fl::repeat_timeout(pUI->refreshInterval * 0.1, cb_refresh, v);
+		return;
+	}
+
+	auto t_now = std::chrono::high_resolution_clock::now();
+	if (!pUI->antialiasing) {
+		pUI->imageRays = TraceUI::resetCount();
+		// Start the antialiasing pass over the finished image.
+		if (pUI->aaSwitch() && !stopTrace) {
+			pUI->antialiasing = true;
+			pUI->renderedPixels = 0;
+			pUI->aaStart = t_now;
+			pUI->raytracer->aaImage();
+			Fl::repeat_timeout(pUI->refreshInterval * 0.1, cb_refresh, v);
+			return;
 		}
-					int frac = min(100,(int)((double)(b_width*b_height*num_blocks)/(double)(width*height)*100.0));
-					// update the window label
-					print(buffer, "%d%% of %s", frac, traceWindowLabel);
-					pUI->m_traceGlWindow->label(buffer);
-				}
-
-				int ix = 0;
-				int iy = 0;
-				if (zOrder) {
-					int mask = 1;
-					for (int nn = 0; nn < bits; nn++) {
-						ix += ((nextBlock & mask) >> nn);
-						mask = mask << 1;
-						iy += ((nextBlock & mask) >> (nn + 1));
-						mask = mask << 1;
-					}
-					ix *= b_width;
-					iy *= b_height;
-					nextBlock++;
-				}
-				else {
-					ix = ii;
-					iy = jj;
-				}
-				// data has changed, update on next refresh
-				pUI->m_debuggingWindow->m_debuggingView->setDirty();
-*/
 	}
+
+#ifdef RT_STATS
+	unsigned long long imageRays = pUI->imageRays;
+#endif
+	auto t_total = std::chrono::duration<double, std::ratio<1>>(t_now - pUI->renderStart).count();
+	if (pUI->antialiasing) {
+		auto t_trace = std::chrono::duration<double, std::ratio<1>>(pUI->aaStart - pUI->renderStart).count();
+		auto t_elapsed = std::chrono::duration<double, std::ratio<1>>(t_now - pUI->aaStart).count();
+#ifdef RT_STATS
+		unsigned long long aaRays = TraceUI::resetCount();
+		print(buffer, "%sTrace: %.2f, Aa: %.2f, Total: %.2f, Rays: %llu, %llu, %llu",
+		      stopTrace ? "Stopped, " : "", t_trace, t_elapsed, t_total, imageRays, aaRays, imageRays + aaRays);
+	} else if (stopTrace)
+		print(buffer, "Stopped: %.2f sec, Rays: %llu", t_total, imageRays);
+	else
+		print(buffer, "Time: %.2f sec, Rays: %llu, Aa: none", t_total, imageRays);
+#else
+		// Rays are only counted in an RT_STATS build.
+		print(buffer, "%sTrace: %.2f, Aa: %.2f, Total: %.2f",
+		      stopTrace ? "Stopped, " : "", t_trace, t_elapsed, t_total);
+	} else if (stopTrace)
+		print(buffer, "Stopped: %.2f sec", t_total);
+	else
+		print(buffer, "Time: %.2f sec, Aa: none", t_total);
+#endif
+	pUI->m_traceGlWindow->copy_label(buffer);
+
+	// data has changed, update on next refresh
+	pUI->m_debuggingWindow->m_debuggingView->setDirty();
 }
 
 void GraphicalUI::cb_stop(Fl_Widget* o, void* v)
@@ -377,6 +386,7 @@ void GraphicalUI::alert( const string& msg )
 void GraphicalUI::setRayTracer(RayTracer *tracer)
 {
 	TraceUI::setRayTracer(tracer);
+	tracer->setAsync(true);
 	m_traceGlWindow->setRayTracer(tracer);
 	m_debuggingWindow->m_debuggingView->setRayTracer(tracer);
 }
@@ -397,6 +407,22 @@ Fl_Menu_Item GraphicalUI::menuitems[] = {
 	{ 0 }
 };
 
+// same order as TraceUI::Accel
+Fl_Menu_Item GraphicalUI::accelMenu[] = {
+	{ "None" },
+	{ "K-d Tree" },
+	{ "BVH" },
+	{ 0 }
+};
+
+// same order as TraceUI::PixelOrder
+Fl_Menu_Item GraphicalUI::orderMenu[] = {
+	{ "Scanline" },
+	{ "Morton" },
+	{ "Hilbert" },
+	{ 0 }
+};
+
 void GraphicalUI::stopTracing()
 {
 	stopTrace = true;
@@ -548,7 +574,7 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_treeDepthSlider->value(m_nTreeDepth);
 	m_treeDepthSlider->align(FL_ALIGN_RIGHT);
 	m_treeDepthSlider->callback(cb_kdTreeDepthSlides);
-	if (!m_kdTree) m_treeDepthSlider->deactivate();
+	if (m_accel != KD_TREE) m_treeDepthSlider->deactivate();
 
 	// install kdleafsize slider
 	m_leafSizeSlider = new Fl_Value_Slider(95, 309, 180, 20, "Target Leaf Size");
@@ -562,7 +588,7 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_leafSizeSlider->value(m_nLeafSize);
 	m_leafSizeSlider->align(FL_ALIGN_RIGHT);
 	m_leafSizeSlider->callback(cb_kdLeafSizeSlides);
-	if (!m_kdTree) m_leafSizeSlider->deactivate();
+	if (m_accel == BRUTE_FORCE) m_leafSizeSlider->deactivate();
 
 	// install cubemap filter width slider
 	m_filterSlider = new Fl_Value_Slider(95, 349, 180, 20, "Filter Width");
@@ -578,11 +604,12 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_filterSlider->callback(cb_filterSlides);
 	if (!m_usingCubeMap) m_filterSlider->deactivate();
 
-	// set up kdTree checkbox
-	m_kdCheckButton = new Fl_Check_Button(10, 293, 80, 20, "K-d Tree");
-	m_kdCheckButton->user_data((void*)(this));
-	m_kdCheckButton->callback(cb_kdCheckButton);
-	m_kdCheckButton->value(m_kdTree);
+	// set up acceleration structure choice
+	m_accelChoice = new Fl_Choice(10, 293, 80, 20);
+	m_accelChoice->user_data((void*)(this));
+	m_accelChoice->menu(accelMenu);
+	m_accelChoice->value(m_accel);
+	m_accelChoice->callback(cb_accelChoice);
 
 	// set up cubeMap checkbox
 	m_cubeMapCheckButton = new Fl_Check_Button(10, 349, 80, 20, "CubeMap");
@@ -617,6 +644,15 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_debuggingDisplayCheckButton->callback(cb_debuggingDisplayCheckButton);
 	m_debuggingDisplayCheckButton->value(m_displayDebuggingInfo);
 
+	// set up pixel order choice
+	m_orderChoice = new Fl_Choice(290, 419, 90, 20, "Order");
+	m_orderChoice->user_data((void*)(this));
+	m_orderChoice->labelfont(FL_COURIER);
+	m_orderChoice->labelsize(12);
+	m_orderChoice->menu(orderMenu);
+	m_orderChoice->value(m_pixelOrder);
+	m_orderChoice->callback(cb_orderChoice);
+
 	m_mainWindow->callback(cb_exit2);
 	m_mainWindow->when(FL_HIDE);
 	m_mainWindow->end();
@@ -13,8 +13,11 @@
 #include <FL/Fl_Value_Slider.H>
 #include <FL/Fl_Check_Button.H>
 #include <FL/Fl_Button.H>
+#include <FL/Fl_Choice.H>
 #include <FL/Fl_File_Chooser.H>
 
+#include <chrono>
+
 #include "TraceUI.h"
 #include "TraceGLWindow.h"
 #include "debuggingWindow.h"
@@ -47,12 +50,14 @@ public:
 
 	Fl_Check_Button*	m_debuggingDisplayCheckButton;
 	Fl_Check_Button*	m_aaCheckButton;
-	Fl_Check_Button*	m_kdCheckButton;
 	Fl_Check_Button*	m_cubeMapCheckButton;
 	Fl_Check_Button*	m_ssCheckButton;
 	Fl_Check_Button*	m_shCheckButton;
 	Fl_Check_Button*	m_bfCheckButton;
 
+	Fl_Choice*			m_accelChoice;
+	Fl_Choice*			m_orderChoice;
+
 	Fl_Button*			m_renderButton;
 	Fl_Button*			m_stopButton;
 
@@ -75,8 +80,18 @@ private:
 
 	clock_t refreshInterval;
 
+	// progress of the render in flight, updated by cb_refresh
+	std::chrono::high_resolution_clock::time_point renderStart;
+	std::chrono::high_resolution_clock::time_point aaStart;
+	int renderedPixels;
+	int renderPixels;
+	unsigned long long imageRays;
+	bool antialiasing; // the second, antialiasing pass is running
+
 	// static class members
 	static Fl_Menu_Item menuitems[];
+	static Fl_Menu_Item accelMenu[];
+	static Fl_Menu_Item orderMenu[];
 
 	static GraphicalUI* whoami(Fl_Menu_* o);
 
@@ -103,13 +118,15 @@ private:
 
 	static void cb_render(Fl_Widget* o, void* v);
 	static void cb_stop(Fl_Widget* o, void* v);
+	static void cb_refresh(void* v);
 	static void cb_debuggingDisplayCheckButton(Fl_Widget* o, void* v);
 	static void cb_aaCheckButton(Fl_Widget* o, void* v);
-	static void cb_kdCheckButton(Fl_Widget* o, void* v);
 	static void cb_cubeMapCheckButton(Fl_Widget* o, void* v);
 	static void cb_ssCheckButton(Fl_Widget* o, void* v);
 	static void cb_shCheckButton(Fl_Widget* o, void* v);
 	static void cb_bfCheckButton(Fl_Widget* o, void* v);
+	static void cb_accelChoice(Fl_Widget* o, void* v);
+	static void cb_orderChoice(Fl_Widget* o, void* v);
 
 	static bool stopTrace;
 	static GraphicalUI* pUI;
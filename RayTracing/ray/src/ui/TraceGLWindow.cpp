@@ -37,7 +37,8 @@ int TraceGLWindow::handle(int event)
 		// Flip for FL's upside-down window coords
 		y = m_nWindowHeight - y;
 
-		if(raytracer) 
+		// The workers own the buffer while a render is in flight.
+		if(raytracer && !raytracer->checkRender())
 		{
 			std::cout << "Tracing ray at " << x << ", " << y << std::endl;
 			// Have we re-sized since drawing?
@@ -62,6 +63,30 @@ int TraceGLWindow::handle(int event)
 
 void TraceGLWindow::draw()
 {
+	unsigned char* buf;
+	raytracer->getBuffer(buf, m_nDrawWidth, m_nDrawHeight);
+
+	// Draw into both buffers so that whichever one we get after the swap
+	// already holds everything painted so far.
+	glDrawBuffer( GL_FRONT_AND_BACK );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+	glPixelStorei( GL_UNPACK_ROW_LENGTH, m_nDrawWidth );
+
+	// Only freshly traced tiles have changed, leave the rest alone.
+	if ( valid() && damage() == FL_DAMAGE_USER1 ) {
+		for ( const Tile& t : m_dirtyTiles ) {
+			if ( !buf || t.x + t.w > m_nDrawWidth || t.y + t.h > m_nDrawHeight )
+				continue;
+			glRasterPos2i( t.x, t.y );
+			glDrawPixels( t.w, t.h, GL_RGB, GL_UNSIGNED_BYTE,
+			              buf + ( t.x + t.y * m_nDrawWidth ) * 3 );
+		}
+		m_dirtyTiles.clear();
+		glFlush();
+		return;
+	}
+	m_dirtyTiles.clear();
+
 	if(!valid())
 	{
 		glClearColor(0.7f, 0.7f, 0.7f, 1.0);
@@ -77,15 +102,9 @@ void TraceGLWindow::draw()
 
 	glClear( GL_COLOR_BUFFER_BIT );
 
-	unsigned char* buf;
-	raytracer->getBuffer(buf, m_nDrawWidth, m_nDrawHeight);
-
 	if ( buf ) {
 		// just copy image to GLwindow conceptually
 		glRasterPos2i( 0, 0 );
-		glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
-		glPixelStorei( GL_UNPACK_ROW_LENGTH, m_nDrawWidth );
-		glDrawBuffer( GL_BACK );
 		glDrawPixels( m_nDrawWidth, m_nDrawHeight, GL_RGB, GL_UNSIGNED_BYTE, buf );
 	}
 		
@@ -94,9 +113,16 @@ void TraceGLWindow::draw()
 
 void TraceGLWindow::refresh()
 {
+	m_dirtyTiles.clear();
 	redraw();
 }
 
+void TraceGLWindow::refreshTile(const Tile& tile)
+{
+	m_dirtyTiles.push_back(tile);
+	damage(FL_DAMAGE_USER1);
+}
+
 void TraceGLWindow::show()
 {
 	label(GraphicalUI::traceWindowLabel);
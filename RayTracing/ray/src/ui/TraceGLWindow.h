@@ -13,6 +13,8 @@
 #include <FL/gl.h>
 #include <FL/glu.h>
 
+#include <vector>
+
 #include "../RayTracer.h"
 
 class TraceGLWindow : public Fl_Gl_Window
@@ -24,6 +26,8 @@ public:
 	int handle(int event);
 
 	void refresh();
+	// Repaint just this part of the image on the next draw.
+	void refreshTile(const Tile& tile);
 
 	void resizeWindow(int width, int height);
 
@@ -35,6 +39,7 @@ private:
 	RayTracer *raytracer;
 	int m_nWindowWidth, m_nWindowHeight;
 	int m_nDrawWidth, m_nDrawHeight;
+	std::vector<Tile> m_dirtyTiles;
 };
 
 #endif // __TRACE_GL_WINDOW_H__
@@ -30,14 +30,37 @@ void load(Json& j, const string& field, T& target)
 
 TraceUI::TraceUI()
 {
-	for (unsigned int i = 0; i < MAX_THREADS; i++)
-		rayCount[i] = 0;
+	resetRayStats();
 }
 
 TraceUI::~TraceUI()
 {
 }
 
+// Only call these while no render is in flight; the counters are not
+// synchronized with the threads writing them.
+RayCounter TraceUI::getRayStats()
+{
+	RayCounter sum = {};
+	for (int t = 0; t < MAX_THREADS; t++) {
+		for (int i = 0; i < RAY_TYPES; i++)
+			sum.byType[i] += rayCount[t].byType[i];
+		for (int i = 0; i < MAX_RAY_DEPTH; i++)
+			sum.byDepth[i] += rayCount[t].byDepth[i];
+		sum.boxes += rayCount[t].boxes;
+		sum.primitives += rayCount[t].primitives;
+	}
+	return sum;
+}
+
+RayCounter TraceUI::resetRayStats()
+{
+	RayCounter sum = getRayStats();
+	for (int t = 0; t < MAX_THREADS; t++)
+		rayCount[t] = RayCounter();
+	return sum;
+}
+
 void TraceUI::setCubeMap(CubeMap* cm)
 {
 	cubemap.reset(cm);
@@ -60,10 +83,47 @@ void TraceUI::loadFromJson(const char* file)
 	load(json, "leaf_size", m_nLeafSize);
 	load(json, "filter_width", m_nFilterWidth);
 	load(json, "anti_alias", m_antiAlias);
-	load(json, "kdtree", m_kdTree);
 	load(json, "shadows", m_shadows);
 	load(json, "smoothshade", m_smoothshade);
 	load(json, "backface_culling", m_backface);
+	load(json, "stats", m_stats);
+	load(json, "packets", m_packets);
+	load(json, "accel_cache", m_accelCache);
+
+	// "kdtree" is true or false for the kd-tree or none at all, or names
+	// the structure.
+	auto accel = json.find("kdtree");
+	if (accel != json.end() && accel->is_boolean()) {
+		m_accel = accel->get<bool>() ? KD_TREE : BRUTE_FORCE;
+	} else if (accel != json.end() && accel->is_string()) {
+		string name = accel->get<string>();
+		if (name == "kd")
+			m_accel = KD_TREE;
+		else if (name == "bvh")
+			m_accel = BVH;
+		else if (name == "none")
+			m_accel = BRUTE_FORCE;
+		else
+			std::cerr << "Unknown kdtree '" << name << "', keeping the default." << std::endl;
+	}
+
+	string precision = json.value("precision", string());
+	if (precision == "float")
+		m_singlePrecision = true;
+	else if (precision == "double")
+		m_singlePrecision = false;
+	else if (!precision.empty())
+		std::cerr << "Unknown precision '" << precision << "', keeping the default." << std::endl;
+
+	string order = json.value("pixel_order", string());
+	if (order == "scanline")
+		m_pixelOrder = SCANLINE;
+	else if (order == "morton")
+		m_pixelOrder = MORTON;
+	else if (order == "hilbert")
+		m_pixelOrder = HILBERT;
+	else if (!order.empty())
+		std::cerr << "Unknown pixel_order '" << order << "', keeping the default." << std::endl;
 	/*
 	 * Note for Students:
 	 * The following options are legacy from previous semesters.
@@ -13,11 +13,51 @@
 
 using std::string;
 
+#define RAY_TYPES 4      // see ray::RayType
+#define MAX_RAY_DEPTH 16 // deeper rays are counted in the last bucket
+
+// Rays traced by one thread, by ray::RayType and by recursion depth, and
+// the work that went into them.
+// Every thread only ever touches its own counter and each counter fills
+// whole cache lines, so counting rays never bounces a line between cores;
+// the counters are only summed up when somebody asks for them.
+// Nothing is counted unless the tracer is built with RT_STATS defined
+// (the RT_STATS CMake option), so a normal build pays nothing for them.
+struct alignas(64) RayCounter {
+	unsigned long long byType[RAY_TYPES];
+	unsigned long long byDepth[MAX_RAY_DEPTH];
+	unsigned long long boxes;      // bounding boxes tested
+	unsigned long long primitives; // objects and triangles tested
+
+	unsigned long long total() const
+	{
+		unsigned long long n = 0;
+		for (int i = 0; i < RAY_TYPES; i++)
+			n += byType[i];
+		return n;
+	}
+};
+
+// RT_STAT(boxes) counts a box test for the calling thread (see ray.h for
+// ray_thread_id), RT_STAT_ADD(primitives, n) n primitive tests.  Without
+// RT_STATS they compile to nothing.
+#ifdef RT_STATS
+#define RT_STAT_ADD(field, n) (TraceUI::counter(ray_thread_id).field += (n))
+#else
+#define RT_STAT_ADD(field, n) ((void)0)
+#endif
+#define RT_STAT(field) RT_STAT_ADD(field, 1)
+
 class RayTracer;
 class CubeMap;
 
 class TraceUI {
 public:
+	// Order in which the image tiles are handed out for tracing.
+	enum PixelOrder { SCANLINE, MORTON, HILBERT };
+	// What the scene's objects are put in for intersecting rays.
+	enum Accel { BRUTE_FORCE, KD_TREE, BVH };
+
 	TraceUI();
 	virtual ~TraceUI();
 
@@ -42,7 +82,8 @@ public:
 	int getFilterWidth() const { return m_nFilterWidth; }
 	int getThreads() const { return m_threads; }
 	bool aaSwitch() const { return m_antiAlias; }
-	bool kdSwitch() const { return m_kdTree; }
+	bool kdSwitch() const { return m_accel == KD_TREE; }
+	Accel getAccel() const { return m_accel; }
 	bool shadowSw() const { return m_shadows; }
 	bool smShadSw() const { return m_smoothshade; }
 	bool bkFaceSw() const { return m_backface; }
@@ -51,43 +92,27 @@ public:
 	void setCubeMap(CubeMap* cm);
 	bool internalReflection() const { return m_internalReflection; }
 	bool backfaceSpecular() const { return m_backfaceSpecular; }
+	PixelOrder getPixelOrder() const { return m_pixelOrder; }
+	bool statsSwitch() const { return m_stats; }
+	bool packetSwitch() const { return m_packets; }
+	bool singlePrecision() const { return m_singlePrecision; }
+	const string& getAccelCache() const { return m_accelCache; }
 
 	// ray counter
-	static void addRays(int number, int ctr)
-	{
-		if (ctr >= 0)
-			rayCount[ctr] += number;
-	}
-	static void addRay(int ctr)
-	{
-		if (ctr >= 0)
-			rayCount[ctr]++;
-	}
-	static int getCount(int ctr) { return ctr < 0 ? -1 : rayCount[ctr]; }
-	static int getCount()
-	{
-		int total = 0;
-		for (int i = 0; i < m_threads; i++)
-			total += rayCount[i];
-		return total;
-	}
-	static int resetCount(int ctr)
-	{
-		if (ctr < 0)
-			return -1;
-		int temp = rayCount[ctr];
-		rayCount[ctr] = 0;
-		return temp;
-	}
-	static int resetCount()
+	static void addRay(int ctr, int type, int depth)
 	{
-		int total = 0;
-		for (int i = 0; i < m_threads; i++) {
-			total += rayCount[i];
-			rayCount[i] = 0;
+#ifdef RT_STATS
+		if (ctr >= 0) {
+			rayCount[ctr].byType[type]++;
+			rayCount[ctr].byDepth[depth < MAX_RAY_DEPTH ? depth : MAX_RAY_DEPTH - 1]++;
 		}
-		return total;
+#endif
 	}
+	static RayCounter& counter(int ctr) { return rayCount[ctr]; }
+	static RayCounter getRayStats();
+	static RayCounter resetRayStats();
+	static unsigned long long getCount() { return getRayStats().total(); }
+	static unsigned long long resetCount() { return resetRayStats().total(); }
 
 	static int m_threads; // number of threads to run
 	static bool m_debug;
@@ -108,20 +133,25 @@ protected:
 	int m_nLeafSize = 10;     // target number of objects per leaf
 	int m_nFilterWidth = 1;   // width of cubemap filter
 
-	static int rayCount[MAX_THREADS]; // Ray counter
+	static RayCounter rayCount[MAX_THREADS]; // Ray counter, one per thread
 
 	// Determines whether or not to show debugging information
 	// for individual rays.  Disabled by default for efficiency
 	// reasons.
 	bool m_displayDebuggingInfo = false;
 	bool m_antiAlias = false;    // Is antialiasing on?
-	bool m_kdTree = true;        // use kd-tree?
 	bool m_shadows = true;       // compute shadows?
 	bool m_smoothshade = true;   // turn on/off smoothshading?
 	bool m_backface = true;      // cull backfaces?
 	bool m_usingCubeMap = false; // render with cubemap
 	bool m_internalReflection = true; // Enable reflection inside a translucent object.
 	bool m_backfaceSpecular = false; // Enable specular component even seeing through the back of a translucent object.
+	bool m_stats = false;        // report render statistics when done
+	bool m_packets = true;       // trace camera and shadow rays in packets
+	bool m_singlePrecision = false; // test the kd-trees' triangles in float
+	string m_accelCache;         // directory of saved kd-trees, none if empty
+	PixelOrder m_pixelOrder = HILBERT; // tile traversal order
+	Accel m_accel = KD_TREE;     // acceleration structure
 
 	std::unique_ptr<CubeMap> cubemap;
 
@@ -332,6 +332,11 @@ void Square::glDrawLocal(int quality, bool actualMaterials, bool actualTextures)
 }
 
 
+void TrimeshInstance::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
+{
+	mesh->glDrawLocal(quality, actualMaterials, actualTextures);
+}
+
 void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
 {
 	// Could be doing this a lot more efficiently w/ vertex arrays, but that